@@ -0,0 +1,510 @@
+/**
+ * @file caximem_user.c
+ * @author wlanxww (xueweiwujxw@outlook.com)
+ * @brief user space driver of a caximem device bound to UIO (uio=1)
+ * @version 0.1
+ * @date 2022-11-02
+ *
+ * @copyright Copyright (c) 2022
+ *
+ * The same enable / size handshake as caximem_write() and caximem_read(),
+ * done on the windows mapped through UIO. Sending and receiving only spin on
+ * the control headers, the UIO device is read to sleep until the next
+ * interrupt once spin_us has passed.
+ *
+ * The batch calls use the record layout of a driver loaded with batch_frames:
+ * messages are packed into the open send slot as caximem_user_rec records and
+ * the slot is handed to the PL once batch_frames messages are in it, the next
+ * message does not fit, or batch_us has passed in caximem_user_batch_poll.
+ * caximem_user_recv_batch returns one message of the received frame per call
+ * and re-arms the window after the last one.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "caximem_user.h"
+
+#define UIO_CLASS "/sys/class/uio"
+
+union caximem_user_reg
+{
+    struct caximem_user_ctrl ctrl;
+    uint32_t word;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// The header is read and written as one word, like memcpy of caximem_ctrl_t in the driver
+static struct caximem_user_ctrl ctrl_get(volatile uint8_t *hdr) {
+    union caximem_user_reg reg;
+    reg.word = *(volatile uint32_t *)hdr;
+    return reg.ctrl;
+}
+
+static void ctrl_set(volatile uint8_t *hdr, bool enable, size_t size) {
+    union caximem_user_reg reg;
+    reg.word = 0;
+    reg.ctrl.enable = enable;
+    reg.ctrl.size = size;
+    // The frame must be in the window before the PL sees the header
+    __sync_synchronize();
+    *(volatile uint32_t *)hdr = reg.word;
+    __sync_synchronize();
+}
+
+// The windows are mapped uncached or write-combining, copy by words and never read past the buffer
+static void copy_to_window(volatile uint8_t *dst, const uint8_t *src, size_t len) {
+    uint32_t word;
+    size_t i;
+    for (i = 0; i + sizeof(word) <= len; i += sizeof(word)) {
+        memcpy(&word, src + i, sizeof(word));
+        *(volatile uint32_t *)(dst + i) = word;
+    }
+    for (; i < len; i++) {
+        dst[i] = src[i];
+    }
+}
+
+static void copy_from_window(uint8_t *dst, volatile uint8_t *src, size_t len) {
+    uint32_t word;
+    size_t i;
+    for (i = 0; i + sizeof(word) <= len; i += sizeof(word)) {
+        word = *(volatile uint32_t *)(src + i);
+        memcpy(dst + i, &word, sizeof(word));
+    }
+    for (; i < len; i++) {
+        dst[i] = src[i];
+    }
+}
+
+static bool send_free(volatile uint8_t *hdr) {
+    return !ctrl_get(hdr).enable;
+}
+
+static bool recv_ready(volatile uint8_t *hdr) {
+    return ctrl_get(hdr).size != 0;
+}
+
+/**
+ * @brief wait until a control header is done, spinning first and then sleeping on the UIO device
+ *
+ * @param dev The caximem user device
+ * @param fd The UIO device raising the interrupt for the header
+ * @param hdr The control header
+ * @param done Checks the header for completion
+ * @param flags CAXIMEM_USER_* flags
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+static int wait_header(struct caximem_user *dev, int fd, volatile uint8_t *hdr, bool (*done)(volatile uint8_t *),
+                       int flags) {
+    uint64_t deadline;
+    uint32_t count;
+    ssize_t n;
+    deadline = now_ns() + (uint64_t)dev->spin_us * 1000;
+    while (!done(hdr)) {
+        if (flags & CAXIMEM_USER_NONBLOCK) {
+            return -EAGAIN;
+        }
+        if (now_ns() < deadline) {
+            continue;
+        }
+        // Returns once an interrupt arrived after the previous read, so none is missed
+        n = read(fd, &count, sizeof(count));
+        if (n < 0 && errno != EINTR) {
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief find a UIO device by name and map its window
+ *
+ * @param name The name of the UIO device
+ * @param fd Returns the opened UIO device
+ * @param size Returns the size of the window
+ * @return volatile uint8_t* Returns the mapped window, or NULL with errno set
+ */
+static volatile uint8_t *uio_map(const char *name, int *fd, size_t *size) {
+    char path[PATH_MAX], buf[64], uio[sizeof(((struct dirent *)0)->d_name)];
+    struct dirent *entry;
+    DIR *dir;
+    FILE *file;
+    void *win;
+    bool found = false;
+
+    dir = opendir(UIO_CLASS);
+    if (dir == NULL) {
+        return NULL;
+    }
+    while (!found && (entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "uio", 3)) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), UIO_CLASS "/%s/name", entry->d_name) >= (int)sizeof(path)) {
+            continue;
+        }
+        file = fopen(path, "r");
+        if (file == NULL) {
+            continue;
+        }
+        if (fgets(buf, sizeof(buf), file) != NULL) {
+            buf[strcspn(buf, "\n")] = '\0';
+            found = strcmp(buf, name) == 0;
+        }
+        fclose(file);
+        if (found) {
+            snprintf(uio, sizeof(uio), "%s", entry->d_name);
+        }
+    }
+    closedir(dir);
+    if (!found) {
+        errno = ENODEV;
+        return NULL;
+    }
+
+    if (snprintf(path, sizeof(path), UIO_CLASS "/%s/maps/map0/size", uio) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    file = fopen(path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    if (fscanf(file, "%zx", size) != 1) {
+        fclose(file);
+        errno = EINVAL;
+        return NULL;
+    }
+    fclose(file);
+
+    if (snprintf(path, sizeof(path), "/dev/%s", uio) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    *fd = open(path, O_RDWR | O_CLOEXEC);
+    if (*fd < 0) {
+        return NULL;
+    }
+    win = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (win == MAP_FAILED) {
+        close(*fd);
+        return NULL;
+    }
+    return win;
+}
+
+/**
+ * @brief open a caximem device bound to UIO and disable its windows
+ *
+ * @param dev The caximem user device to initialize
+ * @param name The device name, <dev_name>_<id> as the char device would be called
+ * @param send_slots The send-slots of the device tree node, 0 or 1 for one slot
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+int caximem_user_open(struct caximem_user *dev, const char *name, unsigned int send_slots) {
+    char uio_name[64];
+    unsigned int i;
+    int rc;
+
+    memset(dev, 0, sizeof(*dev));
+    dev->send_fd = -1;
+    dev->recv_fd = -1;
+    snprintf(uio_name, sizeof(uio_name), "%s_send", name);
+    dev->send_win = uio_map(uio_name, &dev->send_fd, &dev->send_size);
+    if (dev->send_win == NULL) {
+        return -errno;
+    }
+    snprintf(uio_name, sizeof(uio_name), "%s_recv", name);
+    dev->recv_win = uio_map(uio_name, &dev->recv_fd, &dev->recv_size);
+    if (dev->recv_win == NULL) {
+        rc = -errno;
+        caximem_user_close(dev);
+        return rc;
+    }
+
+    dev->send_slots = send_slots ? send_slots : 1;
+    dev->send_slot_size = dev->send_size / dev->send_slots;
+    if (dev->send_slot_size <= sizeof(struct caximem_user_ctrl)) {
+        caximem_user_close(dev);
+        return -EINVAL;
+    }
+    for (i = 0; i < dev->send_slots; i++) {
+        ctrl_set(dev->send_win + i * dev->send_slot_size, false, 0);
+    }
+    ctrl_set(dev->recv_win, false, 0);
+    return 0;
+}
+
+// Disable the windows and unmap them
+void caximem_user_close(struct caximem_user *dev) {
+    unsigned int i;
+    if (dev->send_win != NULL) {
+        for (i = 0; i < dev->send_slots; i++) {
+            ctrl_set(dev->send_win + i * dev->send_slot_size, false, 0);
+        }
+        munmap((void *)dev->send_win, dev->send_size);
+    }
+    if (dev->recv_win != NULL) {
+        ctrl_set(dev->recv_win, false, 0);
+        munmap((void *)dev->recv_win, dev->recv_size);
+    }
+    if (dev->send_fd >= 0) {
+        close(dev->send_fd);
+    }
+    if (dev->recv_fd >= 0) {
+        close(dev->recv_fd);
+    }
+    dev->send_win = NULL;
+    dev->recv_win = NULL;
+    dev->send_fd = -1;
+    dev->recv_fd = -1;
+}
+
+// The largest frame that fits into a send slot
+size_t caximem_user_send_max(const struct caximem_user *dev) {
+    return dev->send_slot_size - sizeof(struct caximem_user_ctrl);
+}
+
+// The largest frame the recv window holds
+size_t caximem_user_recv_max(const struct caximem_user *dev) {
+    return dev->recv_size - sizeof(struct caximem_user_ctrl);
+}
+
+/**
+ * @brief copy a frame into the next free send slot and hand it to the PL
+ *
+ * Returns once the frame is handed over, caximem_user_send_wait waits until it is sent.
+ *
+ * @param dev The caximem user device
+ * @param buf The frame data
+ * @param len The frame length
+ * @param flags CAXIMEM_USER_* flags
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+int caximem_user_send(struct caximem_user *dev, const void *buf, size_t len, int flags) {
+    volatile uint8_t *hdr;
+    int rc;
+    if (len > caximem_user_send_max(dev)) {
+        return -EMSGSIZE;
+    }
+    hdr = dev->send_win + dev->send_slot * dev->send_slot_size;
+    rc = wait_header(dev, dev->send_fd, hdr, send_free, flags);
+    if (rc < 0) {
+        return rc;
+    }
+    copy_to_window(hdr + sizeof(struct caximem_user_ctrl), buf, len);
+    ctrl_set(hdr, true, len);
+    dev->send_slot = (dev->send_slot + 1) % dev->send_slots;
+    return 0;
+}
+
+/**
+ * @brief wait until the PL has sent every frame handed to it
+ *
+ * @param dev The caximem user device
+ * @param flags CAXIMEM_USER_* flags
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+int caximem_user_send_wait(struct caximem_user *dev, int flags) {
+    unsigned int i;
+    int rc;
+    for (i = 0; i < dev->send_slots; i++) {
+        rc = wait_header(dev, dev->send_fd, dev->send_win + i * dev->send_slot_size, send_free, flags);
+        if (rc < 0) {
+            return rc;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief arm the recv window if needed, wait for a frame and copy it out
+ *
+ * With CAXIMEM_USER_NONBLOCK the window stays armed, so the frame can arrive
+ * before the next call.
+ *
+ * @param dev The caximem user device
+ * @param buf The buffer for the frame
+ * @param len The length of buf
+ * @param frame Returns the length of the frame before truncation, may be NULL
+ * @param flags CAXIMEM_USER_* flags
+ * @return ssize_t Returns the number of bytes copied, or error code less than 0 for errors
+ */
+ssize_t caximem_user_recv(struct caximem_user *dev, void *buf, size_t len, size_t *frame, int flags) {
+    struct caximem_user_ctrl ctrl;
+    size_t size;
+    int rc;
+    if (!dev->recv_armed) {
+        ctrl_set(dev->recv_win, true, 0);
+        dev->recv_armed = true;
+    }
+    rc = wait_header(dev, dev->recv_fd, dev->recv_win, recv_ready, flags);
+    if (rc < 0) {
+        return rc;
+    }
+    ctrl = ctrl_get(dev->recv_win);
+    size = ctrl.size;
+    if (size > caximem_user_recv_max(dev)) {
+        size = caximem_user_recv_max(dev);
+    }
+    if (frame != NULL) {
+        *frame = size;
+    }
+    if (len > size) {
+        len = size;
+    }
+    copy_from_window(buf, dev->recv_win + sizeof(struct caximem_user_ctrl), len);
+    ctrl_set(dev->recv_win, false, 0);
+    dev->recv_armed = false;
+    return len;
+}
+
+// The largest message that fits into a batch
+size_t caximem_user_batch_max(const struct caximem_user *dev) {
+    return caximem_user_send_max(dev) - sizeof(struct caximem_user_rec);
+}
+
+/**
+ * @brief hand the open batch to the PL
+ *
+ * @param dev The caximem user device
+ * @return int Returns 0
+ */
+int caximem_user_batch_flush(struct caximem_user *dev) {
+    if (dev->batch_count == 0) {
+        return 0;
+    }
+    ctrl_set(dev->send_win + dev->send_slot * dev->send_slot_size, true, dev->batch_end);
+    dev->send_slot = (dev->send_slot + 1) % dev->send_slots;
+    dev->batch_count = 0;
+    dev->batch_end = 0;
+    return 0;
+}
+
+/**
+ * @brief add a message to the open batch, opening one in the next free send slot if needed
+ *
+ * @param dev The caximem user device
+ * @param buf The message data
+ * @param len The message length
+ * @param flags CAXIMEM_USER_* flags
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+int caximem_user_batch_add(struct caximem_user *dev, const void *buf, size_t len, int flags) {
+    struct caximem_user_rec rec;
+    volatile uint8_t *hdr;
+    size_t offset;
+    int rc;
+    if (len > caximem_user_batch_max(dev)) {
+        return -EMSGSIZE;
+    }
+    offset = (dev->batch_end + CAXIMEM_USER_BATCH_ALIGN - 1) & ~(size_t)(CAXIMEM_USER_BATCH_ALIGN - 1);
+    if (dev->batch_count && offset + sizeof(rec) + len > caximem_user_send_max(dev)) {
+        caximem_user_batch_flush(dev);
+        offset = 0;
+    }
+    hdr = dev->send_win + dev->send_slot * dev->send_slot_size;
+    if (dev->batch_count == 0) {
+        rc = wait_header(dev, dev->send_fd, hdr, send_free, flags);
+        if (rc < 0) {
+            return rc;
+        }
+        dev->batch_start_ns = now_ns();
+    }
+    rec.len = len;
+    hdr += sizeof(struct caximem_user_ctrl) + offset;
+    copy_to_window(hdr, (const uint8_t *)&rec, sizeof(rec));
+    copy_to_window(hdr + sizeof(rec), buf, len);
+    dev->batch_end = offset + sizeof(rec) + len;
+    dev->batch_count++;
+    if (dev->batch_count >= dev->batch_frames) {
+        caximem_user_batch_flush(dev);
+    }
+    return 0;
+}
+
+/**
+ * @brief hand the open batch to the PL once batch_us has passed since its first message
+ *
+ * @param dev The caximem user device
+ * @return int Returns 1 if the batch was handed over, or 0
+ */
+int caximem_user_batch_poll(struct caximem_user *dev) {
+    if (dev->batch_count == 0 || now_ns() - dev->batch_start_ns < (uint64_t)dev->batch_us * 1000) {
+        return 0;
+    }
+    caximem_user_batch_flush(dev);
+    return 1;
+}
+
+/**
+ * @brief get the next message of the batch in the recv window, waiting for a batch if needed
+ *
+ * @param dev The caximem user device
+ * @param buf The buffer for the message
+ * @param len The length of buf
+ * @param msg Returns the length of the message before truncation, may be NULL
+ * @param flags CAXIMEM_USER_* flags
+ * @return ssize_t Returns the number of bytes copied, or error code less than 0 for errors
+ */
+ssize_t caximem_user_recv_batch(struct caximem_user *dev, void *buf, size_t len, size_t *msg, int flags) {
+    struct caximem_user_rec rec;
+    volatile uint8_t *data;
+    size_t size;
+    int rc;
+    while (dev->recv_offset + sizeof(rec) > dev->recv_frame) {
+        if (dev->recv_frame) {
+            // A frame too short for a record
+            ctrl_set(dev->recv_win, false, 0);
+            dev->recv_armed = false;
+            dev->recv_frame = 0;
+        }
+        if (!dev->recv_armed) {
+            ctrl_set(dev->recv_win, true, 0);
+            dev->recv_armed = true;
+        }
+        rc = wait_header(dev, dev->recv_fd, dev->recv_win, recv_ready, flags);
+        if (rc < 0) {
+            return rc;
+        }
+        size = ctrl_get(dev->recv_win).size;
+        dev->recv_frame = size < caximem_user_recv_max(dev) ? size : caximem_user_recv_max(dev);
+        dev->recv_offset = 0;
+    }
+    data = dev->recv_win + sizeof(struct caximem_user_ctrl) + dev->recv_offset;
+    copy_from_window((uint8_t *)&rec, data, sizeof(rec));
+    size = dev->recv_frame - dev->recv_offset - sizeof(rec);
+    if (size > rec.len) {
+        size = rec.len;
+    }
+    if (msg != NULL) {
+        *msg = size;
+    }
+    if (len > size) {
+        len = size;
+    }
+    copy_from_window(buf, data + sizeof(rec), len);
+    dev->recv_offset = (dev->recv_offset + sizeof(rec) + size + CAXIMEM_USER_BATCH_ALIGN - 1) &
+                       ~(size_t)(CAXIMEM_USER_BATCH_ALIGN - 1);
+    if (dev->recv_offset + sizeof(rec) > dev->recv_frame) {
+        // The last message is consumed, let the PL store the next batch
+        ctrl_set(dev->recv_win, false, 0);
+        dev->recv_armed = false;
+        dev->recv_frame = 0;
+    }
+    return len;
+}
@@ -0,0 +1,78 @@
+/**
+ * @file caximem_user.h
+ * @author wlanxww (xueweiwujxw@outlook.com)
+ * @brief user space driver of a caximem device bound to UIO (uio=1)
+ * @version 0.1
+ * @date 2022-11-02
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#ifndef CAXIMEM_USER_H_
+#define CAXIMEM_USER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * The control header at the start of each window and send slot, the same
+ * layout as caximem_ctrl_t of the driver
+ */
+struct caximem_user_ctrl
+{
+    bool enable;            // process enable
+    unsigned int size : 24; // data size in ram
+};
+
+/**
+ * The record header of a batch, the same layout as caximem_batch_rec of the
+ * driver loaded with batch_frames
+ */
+struct caximem_user_rec
+{
+    uint32_t len; // The length of the message after this header
+};
+
+#define CAXIMEM_USER_BATCH_ALIGN 4
+
+struct caximem_user
+{
+    int send_fd;                  // The send UIO device, read for send_signal counts
+    int recv_fd;                  // The recv UIO device, read for recv_signal counts
+    volatile uint8_t *send_win;   // The mapped send window
+    volatile uint8_t *recv_win;   // The mapped recv window
+    size_t send_size;             // The size of the send window
+    size_t recv_size;             // The size of the recv window
+    unsigned int send_slots;      // The number of slots the send window is split into
+    size_t send_slot_size;        // The size of each send slot, including its header
+    unsigned int send_slot;       // The index of the send slot filled next
+    bool recv_armed;              // Whether the recv window is armed
+    unsigned int spin_us;         // The time to spin on a header before blocking on the UIO device
+
+    unsigned int batch_frames;    // The most messages packed into one frame, 0 or 1 for no batching
+    unsigned int batch_us;        // The time caximem_user_batch_poll holds a partial batch back
+    unsigned int batch_count;     // The number of messages in the open batch
+    size_t batch_end;             // The end of the last message in the open batch
+    uint64_t batch_start_ns;      // The time the first message was added to the open batch
+    size_t recv_offset;           // The offset of the next message in the recv window
+    size_t recv_frame;            // The size of the batch in the recv window, 0 if none is held
+};
+
+#define CAXIMEM_USER_NONBLOCK 0x1 // Return -EAGAIN instead of waiting
+
+int caximem_user_open(struct caximem_user *dev, const char *name, unsigned int send_slots);
+void caximem_user_close(struct caximem_user *dev);
+size_t caximem_user_send_max(const struct caximem_user *dev);
+size_t caximem_user_recv_max(const struct caximem_user *dev);
+int caximem_user_send(struct caximem_user *dev, const void *buf, size_t len, int flags);
+int caximem_user_send_wait(struct caximem_user *dev, int flags);
+ssize_t caximem_user_recv(struct caximem_user *dev, void *buf, size_t len, size_t *frame, int flags);
+size_t caximem_user_batch_max(const struct caximem_user *dev);
+int caximem_user_batch_add(struct caximem_user *dev, const void *buf, size_t len, int flags);
+int caximem_user_batch_flush(struct caximem_user *dev);
+int caximem_user_batch_poll(struct caximem_user *dev);
+ssize_t caximem_user_recv_batch(struct caximem_user *dev, void *buf, size_t len, size_t *msg, int flags);
+
+#endif
@@ -33,6 +33,7 @@ MODULE_VERSION("0.1.0");
 MODULE_DESCRIPTION("caximem - loadable module - provide char dev to read and write mem");
 
 #include "caximem.h"
+#include "caximem_ioctl.h"
 
 unsigned int minor_number = MINOR_NUMBER;
 char *driver_name = MODULE_NAME;
@@ -42,48 +43,87 @@ const char *send_buffer_name = SEND_REG_STR;
 const char *recv_buffer_name = RECV_REG_STR;
 module_param(minor_number, int, S_IRUGO);
 module_param(driver_name, charp, S_IRUGO);
+unsigned int recv_ring_slots = 0;
+module_param(recv_ring_slots, uint, S_IRUGO);
+MODULE_PARM_DESC(recv_ring_slots, "Keep receive armed and queue frames in a ring of this many slots (0: recv on read only)");
+unsigned int send_queue_slots = 0;
+module_param(send_queue_slots, uint, S_IRUGO);
+MODULE_PARM_DESC(send_queue_slots, "Queue written frames in this many slots and send them asynchronously (0: write waits for the PL)");
+unsigned int dma_threshold = 0;
+module_param(dma_threshold, uint, S_IRUGO);
+MODULE_PARM_DESC(dma_threshold, "Copy frames of at least this many bytes with a dma channel (0: always copy with the cpu)");
+unsigned int busy_poll_us = 0;
+module_param(busy_poll_us, uint, S_IRUGO);
+MODULE_PARM_DESC(busy_poll_us, "Spin on the control registers for this many microseconds before waiting for the interrupt (0: always wait)");
+unsigned int uio = 0;
+module_param(uio, uint, S_IRUGO);
+MODULE_PARM_DESC(uio, "Expose the windows and interrupts as UIO devices for user space drivers instead of the char device (0: char device)");
+unsigned int pin_threshold = 0;
+module_param(pin_threshold, uint, S_IRUGO);
+MODULE_PARM_DESC(pin_threshold, "Pin the user pages and dma frames of at least this many bytes without a bounce buffer (0: always use the bounce buffer)");
+unsigned int msg_max_size = 0;
+module_param(msg_max_size, uint, S_IRUGO);
+MODULE_PARM_DESC(msg_max_size, "Split messages of up to this many bytes into fragments and reassemble them (0: one frame per write)");
+unsigned int batch_frames = 0;
+module_param(batch_frames, uint, S_IRUGO);
+MODULE_PARM_DESC(batch_frames, "Pack up to this many queued writes into one frame and split received frames into messages (0: one message per frame)");
+unsigned int batch_us = 0;
+module_param(batch_us, uint, S_IRUGO);
+MODULE_PARM_DESC(batch_us, "Hold a partial batch back for at most this many microseconds while the send window is free (0: send it right away)");
+unsigned int recv_poll_budget = 0;
+module_param(recv_poll_budget, uint, S_IRUGO);
+MODULE_PARM_DESC(recv_poll_budget, "Mask recv_signal after a frame and poll the recv window for up to this many frames per round (0: one interrupt per frame)");
+unsigned int recv_poll_us = 0;
+module_param(recv_poll_us, uint, S_IRUGO);
+MODULE_PARM_DESC(recv_poll_us, "Unmask recv_signal once no frame has arrived for this many microseconds while polling");
+unsigned int irq_thread = 0;
+module_param(irq_thread, uint, S_IRUGO);
+MODULE_PARM_DESC(irq_thread, "Handle the interrupts in threads, the hard handlers only take the time (0: hard interrupt context)");
+int irq_cpu = -1;
+module_param(irq_cpu, int, S_IRUGO);
+MODULE_PARM_DESC(irq_cpu, "Steer both interrupts and their threads to this CPU (-1: any CPU)");
+unsigned int irq_prio = 0;
+module_param(irq_prio, uint, S_IRUGO);
+MODULE_PARM_DESC(irq_prio, "Run the interrupt threads at this SCHED_FIFO priority (0: the default of interrupt threads)");
+unsigned int split_nodes = 0;
+module_param(split_nodes, uint, S_IRUGO);
+MODULE_PARM_DESC(split_nodes, "Also create <name>_<id>_tx and <name>_<id>_rx nodes, each owning one direction (0: only <name>_<id>)");
 
-static int caximem_probe(struct platform_device *pdev) {
+/**
+ * @brief read the interrupts, windows, name and id of a device tree node
+ *
+ * @param pdev The platform device
+ * @param caximem_dev The caximem device to fill in
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+static int caximem_probe_of(struct platform_device *pdev, struct caximem_device *caximem_dev) {
     int rc = 0;
-    struct caximem_device *caximem_dev;         // caximem_device pointer
     struct device_node *np = pdev->dev.of_node; // The device tree node structure
     struct resource *send_irq, *recv_irq;       // send and recv irq resource
     struct resource *send_reg, *recv_reg;       // send and recv register resource
     const char *of_name;                        // The name in device tree node
     int id;                                     // The number of deive in device tree node
 
-    // Allocate device structure
-    caximem_dev = kmalloc(sizeof(*caximem_dev), GFP_KERNEL);
-    if (caximem_dev == NULL) {
-        caximem_err("Failed to allocate the CAXI MEM device.\n");
-        return -ENOMEM;
-    }
-    caximem_dev->pdev = pdev;
-
     // Get interrupt
     send_irq = platform_get_resource(pdev, IORESOURCE_IRQ, SEND_IRQ_NO);
     if (send_irq == NULL) {
         caximem_err("Failed to attach irq resource.\n");
-        rc = -EINVAL;
-        goto destroy_mem_dev;
+        return -EINVAL;
     }
     if (strcmp(send_irq->name, send_signal_name)) {
         caximem_err("Error send irq name.\n");
-        rc = -EINVAL;
-        goto destroy_mem_dev;
+        return -EINVAL;
     }
     caximem_dev->send_signal = send_irq->start;
 
     recv_irq = platform_get_resource(pdev, IORESOURCE_IRQ, RECV_IRQ_NO);
     if (recv_irq == NULL) {
         caximem_err("Failed to attach irq resource.\n");
-        rc = -EINVAL;
-        goto destroy_mem_dev;
+        return -EINVAL;
     }
     if (strcmp(recv_irq->name, recv_signal_name)) {
         caximem_err("Error recv irq name.\n");
-        rc = -EINVAL;
-        goto destroy_mem_dev;
+        return -EINVAL;
     }
     caximem_dev->recv_signal = recv_irq->start;
 
@@ -91,13 +131,11 @@ static int caximem_probe(struct platform_device *pdev) {
     send_reg = platform_get_resource(pdev, IORESOURCE_MEM, SEND_REG_NO);
     if (send_reg == NULL) {
         caximem_err("Failed to attach reg resource.\n");
-        rc = -EINVAL;
-        goto destroy_mem_dev;
+        return -EINVAL;
     }
     if (strcmp(send_reg->name, send_buffer_name)) {
         caximem_err("Error send buffer name.\n");
-        rc = -EINVAL;
-        goto destroy_mem_dev;
+        return -EINVAL;
     }
     caximem_dev->send_offset = send_reg->start;
     caximem_dev->send_max_size = send_reg->end - send_reg->start + 1;
@@ -107,13 +145,11 @@ static int caximem_probe(struct platform_device *pdev) {
     recv_reg = platform_get_resource(pdev, IORESOURCE_MEM, RECV_REG_NO);
     if (recv_reg == NULL) {
         caximem_err("Failed to attach reg resource.\n");
-        rc = -EINVAL;
-        goto destroy_mem_dev;
+        return -EINVAL;
     }
     if (strcmp(recv_reg->name, recv_buffer_name)) {
         caximem_err("Error recv buffer name.\n");
-        rc = -EINVAL;
-        goto destroy_mem_dev;
+        return -EINVAL;
     }
     caximem_dev->recv_offset = recv_reg->start;
     caximem_dev->recv_max_size = recv_reg->end - recv_reg->start + 1;
@@ -124,15 +160,113 @@ static int caximem_probe(struct platform_device *pdev) {
     rc = of_property_read_s32(np, "id", &id);
     if (rc < 0) {
         caximem_err("No id parameter\n");
-        goto destroy_mem_dev;
+        return rc;
     }
     caximem_dev->dev_name = of_name;
     caximem_dev->dev_id = id;
 
+    // Bitstreams that drain the send window in slots say so, older ones use one slot
+    if (of_property_read_u32(np, "send-slots", &caximem_dev->send_slots) < 0) {
+        caximem_dev->send_slots = 1;
+    }
+    // Bitstreams whose send window takes bursts and merged writes, it is mapped write-combining
+    caximem_dev->send_wc = of_property_read_bool(np, "write-combine");
+    return 0;
+}
+
+static int caximem_probe(struct platform_device *pdev) {
+    int rc = 0;
+    struct caximem_device *caximem_dev; // caximem_device pointer
+
+    // Allocate device structure
+    caximem_dev = kzalloc(sizeof(*caximem_dev), GFP_KERNEL);
+    if (caximem_dev == NULL) {
+        caximem_err("Failed to allocate the CAXI MEM device.\n");
+        return -ENOMEM;
+    }
+    caximem_dev->pdev = pdev;
+
+    // Get the resources from the device tree, or from the software loopback backend
+    if (caximem_sim_match(pdev)) {
+        rc = caximem_sim_probe(caximem_dev);
+    } else {
+        rc = caximem_probe_of(pdev, caximem_dev);
+    }
+    if (rc < 0) {
+        goto free_mem_dev;
+    }
+    if (caximem_dev->send_slots == 0) {
+        caximem_dev->send_slots = 1;
+    }
+    caximem_dev->send_slot_size = caximem_dev->send_max_size / caximem_dev->send_slots;
+    if (caximem_dev->send_slot_size <= sizeof(caximem_ctrl_t)) {
+        caximem_err("Invalid send-slots %u.\n", caximem_dev->send_slots);
+        rc = -EINVAL;
+        goto free_mem_dev;
+    }
+    caximem_dev->send_queue_slots = send_queue_slots;
+    caximem_dev->recv_ring_slots = recv_ring_slots;
+    caximem_dev->dma_threshold = dma_threshold;
+    caximem_dev->busy_poll_us = busy_poll_us;
+    caximem_dev->pin_threshold = pin_threshold;
+    caximem_dev->msg_max_size = msg_max_size;
+    if (caximem_dev->msg_max_size &&
+        caximem_dev->send_slot_size <= sizeof(caximem_ctrl_t) + sizeof(struct caximem_frag_hdr)) {
+        caximem_err("Send slots too small for message mode.\n");
+        rc = -EINVAL;
+        goto free_mem_dev;
+    }
+    caximem_dev->batch_frames = batch_frames;
+    caximem_dev->batch_us = batch_us;
+    if (caximem_dev->batch_frames &&
+        (!caximem_dev->send_queue_slots || !caximem_dev->recv_ring_slots || caximem_dev->msg_max_size)) {
+        // The batches are packed by the send work and split by the recv work
+        caximem_err("Batch mode needs send_queue_slots and recv_ring_slots, and no message mode.\n");
+        rc = -EINVAL;
+        goto free_mem_dev;
+    }
+    caximem_dev->irq_thread = irq_thread;
+    caximem_dev->irq_cpu = irq_cpu;
+    caximem_dev->irq_prio = irq_prio;
+    // The threads apply irq_prio at their first interrupt
+    atomic_set(&caximem_dev->irq_prio_gen, 1);
+    if (caximem_dev->irq_thread && caximem_dev->sim) {
+        // The simulated device runs the handlers from hard hrtimers, there is no thread
+        caximem_err("Threaded interrupts are not supported by the simulated device.\n");
+        rc = -EINVAL;
+        goto free_mem_dev;
+    }
+    if (caximem_dev->irq_prio >= MAX_RT_PRIO) {
+        caximem_err("Invalid irq_prio %u.\n", caximem_dev->irq_prio);
+        rc = -EINVAL;
+        goto free_mem_dev;
+    }
+    caximem_dev->split_nodes = split_nodes;
+    caximem_dev->recv_poll_budget = recv_poll_budget;
+    caximem_dev->recv_poll_us = recv_poll_us;
+    if (caximem_dev->recv_poll_budget && !caximem_dev->recv_ring_slots) {
+        // Only the recv work polls, a blocking read has busy_poll_us
+        caximem_err("Receive polling needs recv_ring_slots.\n");
+        rc = -EINVAL;
+        goto free_mem_dev;
+    }
+
+    // Bind to UIO for user space drivers
+    if (uio) {
+        rc = caximem_uio_init(caximem_dev);
+        if (rc < 0) {
+            goto free_mem_dev;
+        }
+        dev_set_drvdata(&pdev->dev, caximem_dev);
+        caximem_info("driver probed for uio.\n");
+        return 0;
+    }
+
     // Init character device
     rc = caximem_chrdev_init(caximem_dev);
     if (rc < 0) {
-        goto destroy_mem_dev;
+        // caximem_chrdev_init has already unwound what it set up
+        goto free_mem_dev;
     }
 
     dev_set_drvdata(&pdev->dev, caximem_dev);
@@ -141,8 +275,8 @@ static int caximem_probe(struct platform_device *pdev) {
     caximem_info("driver probed.\n");
     return 0;
 
-destroy_mem_dev:
-    caximem_chrdev_exit(caximem_dev);
+free_mem_dev:
+    caximem_sim_remove(caximem_dev);
     kfree(caximem_dev);
 
     return rc;
@@ -152,7 +286,12 @@ static int caximem_remove(struct platform_device *pdev) {
     struct caximem_device *caximem_dev;
 
     caximem_dev = dev_get_drvdata(&pdev->dev);
-    caximem_chrdev_exit(caximem_dev);
+    if (caximem_dev->uio) {
+        caximem_uio_exit(caximem_dev);
+    } else {
+        caximem_chrdev_exit(caximem_dev);
+    }
+    caximem_sim_remove(caximem_dev);
     kfree(caximem_dev);
     dev_set_drvdata(&pdev->dev, NULL);
 
@@ -178,12 +317,30 @@ static struct platform_driver caximem_driver = {
 };
 
 static int __init caximem_init(void) {
+    int rc;
 
-    return platform_driver_register(&caximem_driver);
+    caximem_debugfs_register();
+    rc = platform_driver_register(&caximem_driver);
+    if (rc < 0) {
+        goto debugfs_cleanup;
+    }
+    rc = caximem_sim_register();
+    if (rc < 0) {
+        goto driver_cleanup;
+    }
+    return 0;
+
+driver_cleanup:
+    platform_driver_unregister(&caximem_driver);
+debugfs_cleanup:
+    caximem_debugfs_unregister();
+    return rc;
 }
 
 static void __exit caximem_exit(void) {
+    caximem_sim_unregister();
     platform_driver_unregister(&caximem_driver);
+    caximem_debugfs_unregister();
 }
 
 module_init(caximem_init);
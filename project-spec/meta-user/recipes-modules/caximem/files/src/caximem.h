@@ -16,8 +16,19 @@
 #include <linux/device.h>
 #include <linux/cdev.h>
 #include <linux/semaphore.h>
+#include <linux/rwsem.h>
 #include <linux/wait.h>
 #include <linux/atomic.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/dmaengine.h>
+#include <linux/uio.h>
+#include <linux/interrupt.h>
+#include <linux/platform_device.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+
+#include "caximem_ioctl.h"
 
 #define MODULE_NAME "caximem"
 #define MINOR_NUMBER 0
@@ -34,6 +45,8 @@
 
 #define CAXIMEM_MAGIC 0x1acffc1dul
 
+#define CAXIMEM_HIST_BUCKETS 32
+
 struct caximem_ctrl
 {
     bool enable;            // process enable
@@ -42,11 +55,129 @@ struct caximem_ctrl
 
 typedef struct caximem_ctrl caximem_ctrl_t;
 
+struct caximem_ring
+{
+    unsigned int slots;  // The number of slots, a power of two
+    size_t slot_size;    // The size of each slot
+    char *data;          // The buffer holding all slots
+    size_t *len;         // The frame length stored in each slot
+    unsigned int head;   // The free running counter of produced frames
+    unsigned int tail;   // The free running counter of consumed frames
+};
+
+struct caximem_dma_path
+{
+    struct dma_chan *chan;  // The dma channel, NULL if the CPU copies
+    void *bounce;           // The DRAM buffer staging frames for the dma
+    dma_addr_t window;      // The dma address of the BRAM window
+    struct completion done; // The completion of the running dma transfer
+};
+
+enum caximem_copy_path
+{
+    CAXIMEM_COPY_CPU,
+    CAXIMEM_COPY_DMA,
+    CAXIMEM_COPY_PIN,
+    CAXIMEM_COPY_PATHS,
+};
+
+struct caximem_copy_stats
+{
+    atomic64_t frames;  // The number of frames copied
+    atomic64_t bytes;   // The number of bytes copied
+    atomic64_t busy_ns; // The time from the start to the end of the copies
+    atomic64_t cpu_ns;  // The part of busy_ns the CPU spent copying
+};
+
+struct caximem_hist
+{
+    atomic64_t buckets[CAXIMEM_HIST_BUCKETS]; // Bucket i counts samples in [2^i, 2^(i+1)) ns
+};
+
+struct caximem_stats
+{
+    atomic64_t send_frames;          // The number of frames handed to the PL
+    atomic64_t send_bytes;           // The number of bytes handed to the PL
+    atomic64_t send_truncated;       // The number of writes truncated to the send window
+    atomic64_t send_irqs;            // The number of send interrupts
+    atomic64_t recv_frames;          // The number of frames taken from the recv window
+    atomic64_t recv_bytes;           // The number of bytes taken from the recv window
+    atomic64_t recv_short;           // The number of reads that returned less than the frame
+    atomic64_t recv_irqs;            // The number of recv interrupts
+    atomic64_t cancels;              // The number of cancel requests
+    atomic64_t recv_dropped;         // The number of incomplete messages dropped in message mode
+    atomic64_t send_records;         // The number of messages packed into frames in batch mode
+    atomic64_t recv_records;         // The number of messages split from frames in batch mode
+    struct caximem_hist doorbell_irq; // The latency from the send doorbell to the send interrupt
+    struct caximem_hist irq_wakeup;   // The latency from an interrupt to the waiter running again
+};
+
+#define CAXIMEM_PINNED_MAX 8
+
+struct caximem_file;
+
+struct caximem_pinned
+{
+    unsigned long addr;          // The user address of the buffer, 0 if the entry is unused
+    size_t len;                  // The length of the buffer
+    struct mm_struct *mm;        // The address space addr belongs to, held with mmgrab
+    struct caximem_file *owner;  // The file that registered the buffer
+    struct page **pages; // The pages of the buffer, pinned until it is unregistered
+    unsigned int npages; // The number of pinned pages
+};
+
+struct caximem_uring_op
+{
+    struct caximem_sqe sqe; // The consumed submission entry
+    u64 submit_ns;          // The time it was consumed
+};
+
+struct caximem_uring_list
+{
+    struct caximem_uring_op *ops; // The consumed entries of one direction
+    unsigned int head;            // The free running counter of completed entries
+    unsigned int issued;          // The free running counter of entries handed to the PL
+    unsigned int tail;            // The free running counter of consumed entries
+};
+
+struct caximem_uring
+{
+    bool active;                     // Whether the rings are set up, they own the device then
+    void *mem;                       // The region shared with user space
+    size_t size;                     // The size of mem
+    struct caximem_uring_ring *ring; // The ring indices at the start of mem
+    struct caximem_sqe *sqes;        // The submission entries in mem
+    struct caximem_cqe *cqes;        // The completion entries in mem
+    void *bufs;                      // The frame buffers in mem
+    unsigned int sq_mask;            // The submission index mask, user space cannot change it
+    unsigned int cq_mask;            // The completion index mask, user space cannot change it
+    unsigned int buf_count;          // The number of frame buffers
+    size_t buf_size;                 // The size of each frame buffer
+    struct caximem_uring_list send;  // The consumed send entries
+    struct caximem_uring_list recv;  // The consumed recv entries
+    struct work_struct work;         // Consumes submissions and posts completions
+    wait_queue_head_t cq_wait;       // The wait queue of CAXIMEM_URING_ENTER
+    struct rw_semaphore lock;        // Serializes setup and free against ENTER and mmap
+};
+
+struct caximem_sim;
+struct eventfd_ctx;
+struct caximem_uio;
+
 struct caximem_device
 {
     unsigned int magic; // Magic number
+    struct caximem_sim *sim; // The software loopback backend, NULL with the FPGA
+    struct caximem_uio *uio; // The UIO binding, NULL with the char device
 
-    struct semaphore file_sem; // Semaphore that guarantees that the file is only opened by one process
+    struct semaphore file_sem;    // Serializes open and release
+    struct rw_semaphore files_sem; // Protects files against the recv work
+    struct list_head files;       // The caximem_file of each open file
+    unsigned int files_open;      // The number of open files
+    unsigned int send_open;       // The number of open files owning the send direction
+    unsigned int send_shared;     // The number of files owning the send direction opened without O_EXCL
+    unsigned int recv_open;       // The number of open files owning the recv direction
+    unsigned int recv_shared;     // The number of files owning the recv direction opened without O_EXCL
     /**
      * send process
      */
@@ -55,10 +186,26 @@ struct caximem_device
     unsigned long send_offset;      // Then beginning offset of dev memory for sending data
     unsigned long send_max_size;    // The maximum dev memory size for sending data
     void *send_buffer;              // The buffer for sending data
-    caximem_ctrl_t *send_info_reg;  // The info reg for sending data
+    bool send_wc;                   // Whether the send window is mapped write-combining
+    caximem_ctrl_t *send_info_reg;  // The info reg of the send slot filled next
+    unsigned int send_slots;        // The number of slots the send window is split into
+    unsigned long send_slot_size;   // The size of each send slot, including its info reg
+    unsigned int send_slot;         // The index of the send slot filled next
     caximem_ctrl_t send_info;       // The info for sending data
     wait_queue_head_t send_wq_head; // The wait queue header for sending
-    atomic_t send_wait;             // The atomic counter for sending
+    atomic_t send_wait;             // The number of send slots handed to the PL
+    unsigned int send_queue_slots;  // The number of queue slots for asynchronous sending, 0 to disable
+    struct caximem_ring send_queue; // The queue of frames waiting for the send window
+    struct work_struct send_work;   // The work feeding queued frames into the send window
+    atomic_t send_busy;             // The number of queued frames the PL is still sending
+    atomic_t send_discard;          // 1 drops the queued frames, 2 waits for the PL to reset the slots
+    bool send_active;               // Whether queued frames are fed to the PL
+    spinlock_t send_reserve_lock;   // Protects send_reserved
+    unsigned int send_reserved;     // The queue slots reserved by shared writers but not pushed yet
+    atomic_t send_polled;           // The number of send interrupts already handled by busy poll
+    u64 *send_doorbell_ns;          // The time the frame of each send slot was handed to the PL
+    unsigned int send_irq_slot;     // The index of the send slot the next send interrupt completes
+    u64 send_irq_ns;                // The time of the last send interrupt
 
     /**
      * recv process
@@ -72,6 +219,68 @@ struct caximem_device
     caximem_ctrl_t recv_info;       // The info for reving data
     wait_queue_head_t recv_wq_head; // The wait queue header for recving
     atomic_t recv_wait;             // The atomic counter for recving
+    unsigned int recv_ring_slots;   // The number of ring slots for continuous recving, 0 to disable
+    struct caximem_ring recv_ring;  // The ring of frames drained from the recv window
+    struct work_struct recv_work;   // The work draining the recv window into the ring
+    atomic_t recv_pending;          // The number of frames waiting in the recv window
+    atomic_t recv_cancel;           // The counter of cancel requests for ring readers
+    bool recv_active;               // Whether the recv window is kept armed
+    bool recv_armed;                // Whether the recv window is armed for a blocking read
+    atomic_t recv_polled;           // The number of recv interrupts already handled by busy poll
+    unsigned int recv_poll_budget;  // The frames taken per round while recv_signal is masked, 0 to disable
+    unsigned int recv_poll_us;      // The quiet time after which recv_signal is unmasked again
+    atomic_t recv_polling;          // Whether recv_signal is masked and the recv work polls the window
+    u64 recv_irq_ns;                // The time of the last recv interrupt
+
+    /**
+     * interrupt handling
+     */
+    bool irq_thread;       // Whether the interrupts are handled in threads
+    int irq_cpu;           // The CPU both interrupts are steered to, -1 for any
+    unsigned int irq_prio; // The SCHED_FIFO priority of the interrupt threads, 0 for the default
+    atomic_t irq_prio_gen; // Bumped on each change of irq_prio
+    int send_prio_gen;     // The irq_prio_gen the send interrupt thread has applied
+    int recv_prio_gen;     // The irq_prio_gen the recv interrupt thread has applied
+
+    /**
+     * busy poll
+     */
+    unsigned int busy_poll_us; // The time to spin on the control registers before sleeping, 0 to disable
+    unsigned int msg_max_size; // The largest message split into fragments, 0 for one frame per write
+
+    /**
+     * batch mode
+     */
+    unsigned int batch_frames;  // The most messages packed into one frame, 0 to disable
+    unsigned int batch_us;      // The time a partial batch is held back while the send window is free
+    struct hrtimer batch_timer; // Sends a partial batch once batch_us has passed
+    atomic_t batch_flush;       // Whether a partial batch is sent right away
+    size_t recv_batch_offset;   // The offset of the next message in the recv window
+
+    /**
+     * event notification
+     */
+    spinlock_t event_lock;              // Protects the eventfds against the interrupt handlers
+    struct eventfd_ctx *send_eventfd;   // Signaled when a frame has been sent, NULL if not attached
+    struct eventfd_ctx *recv_eventfd;   // Signaled when a frame can be read, NULL if not attached
+    struct caximem_uring uring;         // The submission and completion rings
+
+    /**
+     * copy path
+     */
+    unsigned int dma_threshold;                            // The frame size from which dma is used, 0 to disable
+    struct caximem_dma_path send_dma;                      // The dma path into the send window
+    struct caximem_dma_path recv_dma;                      // The dma path out of the recv window
+    struct caximem_copy_stats copy_stats[CAXIMEM_COPY_PATHS]; // The statistics of each copy path
+    unsigned int pin_threshold;                            // The frame size from which user pages are pinned, 0 to disable
+    struct caximem_pinned pinned[CAXIMEM_PINNED_MAX];      // The user buffers registered with CAXIMEM_REGISTER_BUF
+    struct rw_semaphore pin_sem;                           // Protects pinned against the copies using it
+
+    /**
+     * statistics
+     */
+    struct caximem_stats stats; // The counters and latency histograms
+    struct dentry *debugfs;     // The debugfs directory of the histograms
 
     /**
      * character device
@@ -79,6 +288,9 @@ struct caximem_device
     int minor;                    // The major number of the device
     dev_t cdevno;                 // The device number of the device
     struct device *sys_device;    // Device structure for the device
+    unsigned int split_nodes;     // Whether the tx and rx nodes owning one direction each are created
+    struct device *tx_device;     // Device structure for the tx node, NULL without split_nodes
+    struct device *rx_device;     // Device structure for the rx node, NULL without split_nodes
     struct class *dev_class;      // Device class for the device
     struct cdev chrdev;           // Character device structure for the device
     struct platform_device *pdev; // Platform device structure for the device
@@ -86,9 +298,86 @@ struct caximem_device
     int dev_id;                   // The id of the device
 };
 
+struct caximem_file_stats
+{
+    atomic64_t send_frames;  // The number of frames written through the file
+    atomic64_t send_bytes;   // The number of bytes written through the file
+    atomic64_t recv_frames;  // The number of frames read through the file
+    atomic64_t recv_bytes;   // The number of bytes read through the file
+    atomic64_t recv_dropped; // The number of frames lost because the recv ring of the file was full
+};
+
+// The directions a file owns, the main node owns both
+#define CAXIMEM_FILE_SEND 0x1
+#define CAXIMEM_FILE_RECV 0x2
+#define CAXIMEM_FILE_DUPLEX (CAXIMEM_FILE_SEND | CAXIMEM_FILE_RECV)
+
+struct caximem_file
+{
+    struct caximem_device *dev;      // The device the file is opened on
+    unsigned int dirs;               // The directions of the node the file is opened on
+    bool shared;                     // Whether the file was opened without O_EXCL
+    struct list_head node;           // The entry in files of the device
+    struct semaphore recv_sem;       // Serializes the readers of a shared file
+    struct caximem_ring recv_ring;   // The frames delivered to a shared file
+    atomic_t recv_cancel;            // The counter of cancel requests for the readers of a shared file
+    atomic_t send_reserved;          // The send queue slots reserved by the writers of a shared file
+    unsigned int send_head;          // The send queue head after the last frame written through a shared file
+    struct caximem_file_stats stats; // The counters of the file, shown in fdinfo
+};
+
 int caximem_chrdev_init(struct caximem_device *dev);
 void caximem_chrdev_exit(struct caximem_device *dev);
 
+int caximem_copy_to_window(struct caximem_device *dev, struct iov_iter *from, size_t offset, size_t length);
+int caximem_copy_from_window(struct caximem_device *dev, struct iov_iter *to, size_t offset, size_t length);
+void caximem_dma_init(struct caximem_device *dev);
+void caximem_dma_exit(struct caximem_device *dev);
+int caximem_pin_register(struct caximem_device *dev, struct caximem_file *owner, unsigned long addr, size_t len);
+int caximem_pin_unregister(struct caximem_device *dev, struct caximem_file *owner, unsigned long addr);
+void caximem_pin_release(struct caximem_device *dev, struct caximem_file *owner);
+
+extern const struct attribute_group *caximem_groups[];
+int caximem_sim_probe(struct caximem_device *dev);
+void caximem_sim_remove(struct caximem_device *dev);
+void caximem_sim_attach(struct caximem_device *dev, irq_handler_t send_irq, irq_handler_t recv_irq);
+void caximem_sim_detach(struct caximem_device *dev);
+void caximem_sim_doorbell(struct caximem_device *dev, bool send);
+int caximem_sim_register(void);
+void caximem_sim_unregister(void);
+bool caximem_sim_match(struct platform_device *pdev);
+bool caximem_send_idle(struct caximem_device *caximem_dev);
+void caximem_send_locked(struct caximem_device *caximem_dev, size_t length, bool nonblock);
+int caximem_recv_locked(struct caximem_device *caximem_dev, bool nonblock, size_t *size);
+void caximem_recv_disarm(struct caximem_device *caximem_dev);
+void caximem_uring_init(struct caximem_device *dev);
+int caximem_uring_setup(struct caximem_device *dev, struct caximem_uring_params *params);
+void caximem_uring_free(struct caximem_device *dev);
+int caximem_uring_enter(struct caximem_device *dev, struct caximem_uring_enter *enter);
+int caximem_uring_mmap(struct caximem_device *dev, struct vm_area_struct *vma);
+void caximem_uring_kick(struct caximem_device *dev);
+int caximem_irq_affinity(struct caximem_device *dev);
+int caximem_uio_init(struct caximem_device *dev);
+void caximem_uio_exit(struct caximem_device *dev);
+
+void caximem_hist_add(struct caximem_hist *hist, u64 ns);
+void caximem_debugfs_init(struct caximem_device *dev);
+void caximem_debugfs_exit(struct caximem_device *dev);
+void caximem_debugfs_register(void);
+void caximem_debugfs_unregister(void);
+
+int caximem_ring_init(struct caximem_ring *ring, unsigned int slots, size_t slot_size);
+void caximem_ring_free(struct caximem_ring *ring);
+void caximem_ring_reset(struct caximem_ring *ring);
+bool caximem_ring_empty(struct caximem_ring *ring);
+bool caximem_ring_full(struct caximem_ring *ring);
+void *caximem_ring_head(struct caximem_ring *ring);
+void caximem_ring_push(struct caximem_ring *ring, size_t len);
+void *caximem_ring_tail(struct caximem_ring *ring, size_t *len);
+void caximem_ring_pop(struct caximem_ring *ring);
+unsigned int caximem_ring_count(struct caximem_ring *ring);
+void *caximem_ring_peek(struct caximem_ring *ring, unsigned int i, size_t *len);
+
 #define __FILENAME__ \
     (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
 
@@ -19,11 +19,32 @@
 #include <linux/interrupt.h>
 #include <linux/cdev.h>
 #include <linux/string.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/eventfd.h>
+#include <linux/seq_file.h>
+#include <linux/cpumask.h>
+#include <uapi/linux/sched/types.h>
 
 #include "caximem.h"
 #include "caximem_ioctl.h"
 
+#define CREATE_TRACE_POINTS
+#include "caximem_trace.h"
+
 static const char *dev_fmt = "%s_%d";
+static const char *tx_fmt = "%s_%d_tx";
+static const char *rx_fmt = "%s_%d_rx";
+
+// The main node and, with split_nodes, the tx and rx nodes
+#define CAXIMEM_NODES 3
+
+// The directions owned by the files of each node, indexed by minor
+static const unsigned int caximem_node_dirs[CAXIMEM_NODES] = {CAXIMEM_FILE_DUPLEX, CAXIMEM_FILE_SEND, CAXIMEM_FILE_RECV};
 
 void caximem_ctrl_set(void *phyaddr, caximem_ctrl_t *kaddr) {
     memcpy(phyaddr, (void *)kaddr, sizeof(caximem_ctrl_t));
@@ -33,185 +54,1925 @@ void caximem_ctrl_get(void *phyaddr, caximem_ctrl_t *kaddr) {
     memcpy((void *)kaddr, phyaddr, sizeof(caximem_ctrl_t));
 }
 
-static irqreturn_t send_irq_handler(int irq, void *dev) {
-    struct caximem_device *cdev;
+/**
+ * @brief signal the eventfd attached for a direction with CAXIMEM_SET_EVENTFD
+ *
+ * @param caximem_dev The caximem device
+ * @param send Whether a frame has been sent or can be read
+ */
+static void caximem_event_signal(struct caximem_device *caximem_dev, bool send) {
+    struct eventfd_ctx *ctx;
+    unsigned long flags;
+    spin_lock_irqsave(&caximem_dev->event_lock, flags);
+    ctx = send ? caximem_dev->send_eventfd : caximem_dev->recv_eventfd;
+    if (ctx) {
+        eventfd_signal(ctx, 1);
+    }
+    spin_unlock_irqrestore(&caximem_dev->event_lock, flags);
+}
+
+/**
+ * @brief replace the eventfd of one direction, the old one is released
+ *
+ * @param caximem_dev The caximem device
+ * @param slot send_eventfd or recv_eventfd
+ * @param fd The eventfd to attach, or -1 to detach
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+static int caximem_set_eventfd(struct caximem_device *caximem_dev, struct eventfd_ctx **slot, int fd) {
+    struct eventfd_ctx *ctx = NULL, *old;
+    unsigned long flags;
+    if (fd >= 0) {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx)) {
+            return PTR_ERR(ctx);
+        }
+    }
+    spin_lock_irqsave(&caximem_dev->event_lock, flags);
+    old = *slot;
+    *slot = ctx;
+    spin_unlock_irqrestore(&caximem_dev->event_lock, flags);
+    if (old) {
+        eventfd_ctx_put(old);
+    }
+    return 0;
+}
+
+/**
+ * @brief mask or unmask recv_signal while the recv work polls the recv window
+ *
+ * @param caximem_dev The caximem device
+ * @param mask Whether to mask the interrupt
+ */
+static void caximem_recv_irq_mask(struct caximem_device *caximem_dev, bool mask) {
+    if (caximem_dev->sim) {
+        // The simulated PL calls the handler directly, recv_polling keeps it out
+        return;
+    }
+    if (mask) {
+        disable_irq_nosync(caximem_dev->recv_signal);
+    } else {
+        enable_irq(caximem_dev->recv_signal);
+    }
+}
+
+// Mask recv_signal and let the recv work poll, unless it polls already
+static void caximem_recv_poll_start(struct caximem_device *caximem_dev) {
+    if (atomic_xchg(&caximem_dev->recv_polling, 1)) {
+        return;
+    }
+    caximem_recv_irq_mask(caximem_dev, true);
+    queue_work(system_highpri_wq, &caximem_dev->recv_work);
+}
+
+/**
+ * Interrupt handling
+ *
+ * By default both signals are handled in hard interrupt context. With
+ * irq_thread the hard handlers only take the time of the interrupt and
+ * everything else runs in the interrupt threads, at the SCHED_FIFO priority
+ * irq_prio if set. irq_cpu steers both interrupts, and so their threads, to
+ * one CPU. The simulated device calls the combined handlers directly, from
+ * its hrtimers, so irq_thread is refused with sim.
+ */
+
+/**
+ * @brief run the interrupt thread at irq_prio, only called from the interrupt threads
+ *
+ * The priority is only changed on the first interrupt and after irq_prio is
+ * written in sysfs.
+ *
+ * @param cdev The caximem device
+ * @param applied The irq_prio_gen the calling thread has applied
+ */
+static void caximem_irq_prio(struct caximem_device *cdev, int *applied) {
+    struct sched_attr attr = {
+        .sched_policy = SCHED_FIFO,
+    };
+    unsigned int prio;
+    int gen;
+    gen = atomic_read(&cdev->irq_prio_gen);
+    if (*applied == gen) {
+        return;
+    }
+    *applied = gen;
+    prio = READ_ONCE(cdev->irq_prio);
+    if (prio == 0 || current->rt_priority == prio) {
+        return;
+    }
+    attr.sched_priority = prio;
+    sched_setattr_nocheck(current, &attr);
+}
+
+/**
+ * @brief set the affinity of both interrupts to irq_cpu
+ *
+ * @param dev The caximem device
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+int caximem_irq_affinity(struct caximem_device *dev) {
+    const struct cpumask *mask = NULL;
+    int cpu, rc;
+    cpu = READ_ONCE(dev->irq_cpu);
+    if (dev->sim) {
+        return 0;
+    }
+    if (cpu >= 0) {
+        if (cpu >= nr_cpu_ids || !cpu_online(cpu)) {
+            return -EINVAL;
+        }
+        mask = cpumask_of(cpu);
+    }
+    rc = irq_set_affinity_hint(dev->send_signal, mask);
+    if (rc < 0) {
+        return rc;
+    }
+    return irq_set_affinity_hint(dev->recv_signal, mask);
+}
 
+static irqreturn_t send_irq_hard(int irq, void *dev) {
+    struct caximem_device *cdev;
     cdev = (struct caximem_device *)dev;
-    atomic_dec(&cdev->send_wait);
+    WRITE_ONCE(cdev->send_irq_ns, ktime_get_ns());
+    return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t send_irq_body(struct caximem_device *cdev) {
+    u64 irq_ns, doorbell_ns, delay;
+
+    // The PL completes the slots in the order they were handed over
+    irq_ns = READ_ONCE(cdev->send_irq_ns);
+    doorbell_ns = READ_ONCE(cdev->send_doorbell_ns[cdev->send_irq_slot]);
+    cdev->send_irq_slot = (cdev->send_irq_slot + 1) % cdev->send_slots;
+    delay = irq_ns > doorbell_ns ? irq_ns - doorbell_ns : 0;
+    atomic64_inc(&cdev->stats.send_irqs);
+    caximem_hist_add(&cdev->stats.doorbell_irq, delay);
+    trace_caximem_irq(cdev->dev_id, true, delay);
+    if (cdev->send_queue_slots) {
+        atomic_dec_if_positive(&cdev->send_busy);
+        queue_work(system_highpri_wq, &cdev->send_work);
+    } else if (atomic_dec_if_positive(&cdev->send_polled) < 0) {
+        atomic_dec_if_positive(&cdev->send_wait);
+    }
     wake_up(&cdev->send_wq_head);
-    caximem_debug("caximem send irq triggered. %d, %d\n", irq, cdev->send_signal);
+    caximem_event_signal(cdev, true);
+    caximem_uring_kick(cdev);
     return IRQ_HANDLED;
 }
 
-static irqreturn_t recv_irq_handler(int irq, void *dev) {
+static irqreturn_t send_irq_thread(int irq, void *dev) {
     struct caximem_device *cdev;
+    cdev = (struct caximem_device *)dev;
+    caximem_irq_prio(cdev, &cdev->send_prio_gen);
+    return send_irq_body(cdev);
+}
+
+static irqreturn_t send_irq_handler(int irq, void *dev) {
+    send_irq_hard(irq, dev);
+    return send_irq_body((struct caximem_device *)dev);
+}
 
+static irqreturn_t recv_irq_hard(int irq, void *dev) {
+    struct caximem_device *cdev;
     cdev = (struct caximem_device *)dev;
-    atomic_dec(&cdev->recv_wait);
-    wake_up(&cdev->recv_wq_head);
-    caximem_debug("caximem recv irq triggered. %d, %d\n", irq, cdev->recv_signal);
+    WRITE_ONCE(cdev->recv_irq_ns, ktime_get_ns());
+    return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t recv_irq_body(struct caximem_device *cdev) {
+    atomic64_inc(&cdev->stats.recv_irqs);
+    trace_caximem_irq(cdev->dev_id, false, 0);
+    if (cdev->recv_ring_slots && cdev->recv_poll_budget) {
+        caximem_recv_poll_start(cdev);
+    } else if (cdev->recv_ring_slots) {
+        atomic_inc(&cdev->recv_pending);
+        queue_work(system_highpri_wq, &cdev->recv_work);
+    } else {
+        if (atomic_dec_if_positive(&cdev->recv_polled) < 0) {
+            atomic_set(&cdev->recv_wait, 0);
+            wake_up(&cdev->recv_wq_head);
+        }
+        caximem_event_signal(cdev, false);
+        caximem_uring_kick(cdev);
+    }
     return IRQ_HANDLED;
 }
 
+static irqreturn_t recv_irq_thread(int irq, void *dev) {
+    struct caximem_device *cdev;
+    cdev = (struct caximem_device *)dev;
+    caximem_irq_prio(cdev, &cdev->recv_prio_gen);
+    return recv_irq_body(cdev);
+}
+
+static irqreturn_t recv_irq_handler(int irq, void *dev) {
+    recv_irq_hard(irq, dev);
+    return recv_irq_body((struct caximem_device *)dev);
+}
+
 /**
- * File Operations
+ * recv_wait is 1 while an armed recv window waits for its interrupt, and 0
+ * otherwise. send_wait counts the send slots handed to the PL.
+ *
+ * With the send-slots device tree property the send window is split into
+ * equal slots, each starting with its own caximem_ctrl_t. The PL drains the
+ * slots in order and raises send_signal once per slot, so the next frame is
+ * copied into a free slot while the PL still sends the previous one.
  */
 
+// Check if the send window has a free slot for the next frame
+bool caximem_send_idle(struct caximem_device *caximem_dev) {
+    return atomic_read(&caximem_dev->send_wait) < caximem_dev->send_slots;
+}
+
 /**
- * @brief read data from character device
+ * @brief disable every send slot, the slot filled next is not changed
  *
- * @param file The file structure pointer
- * @param buffer The memory address of user space
- * @param length The number of bytes to read
- * @param offset The offset of the read position relative to the beginning of the file
- * @return ssize_t Returns the number of bytes read, or error code less than 0 for errors
+ * @param caximem_dev The caximem device
  */
-static ssize_t caximem_read(struct file *file, char __user *buffer, size_t length, loff_t *offset) {
-    unsigned long p;
+static void caximem_send_clear(struct caximem_device *caximem_dev) {
+    unsigned int i;
+    caximem_dev->send_info.size = 0;
+    caximem_dev->send_info.enable = false;
+    for (i = 0; i < caximem_dev->send_slots; i++) {
+        caximem_ctrl_set((char *)caximem_dev->send_buffer + i * caximem_dev->send_slot_size, &caximem_dev->send_info);
+    }
+}
+
+// Disable every send slot and fill the first one next
+static void caximem_send_reset(struct caximem_device *caximem_dev) {
+    caximem_send_clear(caximem_dev);
+    caximem_dev->send_slot = 0;
+    caximem_dev->send_irq_slot = 0;
+    caximem_dev->send_info_reg = (caximem_ctrl_t *)caximem_dev->send_buffer;
+}
+
+// Check if the armed recv window holds a frame
+static bool caximem_recv_ready(struct caximem_device *caximem_dev) {
+    return atomic_read(&caximem_dev->recv_wait) == 0;
+}
+
+// Check if the PL has cleared enable after sending the frame
+static bool caximem_send_reg_done(struct caximem_device *caximem_dev) {
+    caximem_ctrl_t info;
+    caximem_ctrl_get(caximem_dev->send_info_reg, &info);
+    return !info.enable;
+}
+
+// Check if the PL has stored a frame size in the armed recv window
+static bool caximem_recv_reg_done(struct caximem_device *caximem_dev) {
+    caximem_ctrl_t info;
+    caximem_ctrl_get(caximem_dev->recv_info_reg, &info);
+    return info.size != 0;
+}
+
+/**
+ * @brief spin on a control register for at most busy_poll_us before the caller sleeps
+ *
+ * A completion seen in the register is claimed by clearing the wait flag
+ * here, and polled makes the interrupt arriving later skip it. If the
+ * interrupt wins the race, the claim is dropped again.
+ *
+ * @param caximem_dev The caximem device
+ * @param wait send_wait or recv_wait
+ * @param polled send_polled or recv_polled
+ * @param done Checks the control register for completion
+ */
+static void caximem_busy_poll(struct caximem_device *caximem_dev, atomic_t *wait, atomic_t *polled,
+                              bool (*done)(struct caximem_device *)) {
+    unsigned int budget;
+    u64 deadline;
+    budget = READ_ONCE(caximem_dev->busy_poll_us);
+    if (budget == 0) {
+        return;
+    }
+    deadline = ktime_get_ns() + (u64)budget * NSEC_PER_USEC;
+    while (atomic_read(wait)) {
+        if (done(caximem_dev)) {
+            atomic_inc(polled);
+            if (atomic_cmpxchg(wait, 1, 0) != 1) {
+                atomic_dec(polled);
+            }
+            return;
+        }
+        if (need_resched() || ktime_get_ns() > deadline) {
+            return;
+        }
+        cpu_relax();
+    }
+}
+
+/**
+ * @brief account the latency from the interrupt to the waiter running again
+ *
+ * Wakeups without an interrupt during the sleep (cancel, busy poll) are not counted.
+ *
+ * @param caximem_dev The caximem device
+ * @param send Whether the waiter waited for the send interrupt
+ * @param sleep_ns The time the waiter went to sleep
+ */
+static void caximem_wakeup_account(struct caximem_device *caximem_dev, bool send, u64 sleep_ns) {
+    u64 irq, latency;
+    irq = READ_ONCE(send ? caximem_dev->send_irq_ns : caximem_dev->recv_irq_ns);
+    if (irq >= sleep_ns) {
+        latency = ktime_get_ns() - irq;
+        caximem_hist_add(&caximem_dev->stats.irq_wakeup, latency);
+        trace_caximem_wakeup(caximem_dev->dev_id, send, latency);
+    }
+}
+
+// Ring the send doorbell for the frame in the current slot and move on to the next slot
+static void caximem_send_doorbell(struct caximem_device *caximem_dev, size_t length) {
+    atomic64_inc(&caximem_dev->stats.send_frames);
+    atomic64_add(length, &caximem_dev->stats.send_bytes);
+    caximem_dev->send_info.size = length;
+    caximem_dev->send_info.enable = true;
+    WRITE_ONCE(caximem_dev->send_doorbell_ns[caximem_dev->send_slot], ktime_get_ns());
+    // The frame must reach the window before the PL sees the header, and with a
+    // write-combining window the header must not wait in the write buffer
+    wmb();
+    caximem_ctrl_set(caximem_dev->send_info_reg, &caximem_dev->send_info);
+    wmb();
+    if (caximem_dev->send_slots > 1) {
+        caximem_dev->send_slot = (caximem_dev->send_slot + 1) % caximem_dev->send_slots;
+        caximem_dev->send_info_reg =
+            (caximem_ctrl_t *)((char *)caximem_dev->send_buffer + caximem_dev->send_slot * caximem_dev->send_slot_size);
+    }
+    trace_caximem_doorbell(caximem_dev->dev_id, length);
+    if (caximem_dev->sim) {
+        caximem_sim_doorbell(caximem_dev, true);
+    }
+}
+
+/**
+ * @brief wait until the send window has a free slot
+ *
+ * @param caximem_dev The caximem device, send_sem must be held
+ * @param nonblock Return -EAGAIN instead of waiting
+ * @return int Returns 0 when a slot is free, or -EAGAIN
+ */
+static int caximem_send_wait_idle(struct caximem_device *caximem_dev, bool nonblock) {
+    u64 sleep_ns;
+    if (caximem_send_idle(caximem_dev)) {
+        return 0;
+    }
+    if (nonblock) {
+        return -EAGAIN;
+    }
+    if (caximem_dev->send_slots == 1) {
+        caximem_busy_poll(caximem_dev, &caximem_dev->send_wait, &caximem_dev->send_polled, caximem_send_reg_done);
+    }
+    sleep_ns = ktime_get_ns();
+    wait_event(caximem_dev->send_wq_head, caximem_send_idle(caximem_dev));
+    caximem_wakeup_account(caximem_dev, true, sleep_ns);
+    return 0;
+}
+
+/**
+ * @brief hand the frame in the current send slot over to the PL
+ *
+ * With a single slot the caller waits until the frame is sent. With more
+ * slots it returns right away, the next write waits for a free slot.
+ *
+ * @param caximem_dev The caximem device, send_sem must be held and a slot free
+ * @param length The number of bytes already placed after the control header
+ * @param nonblock Return right after the doorbell instead of waiting until it is sent
+ */
+void caximem_send_locked(struct caximem_device *caximem_dev, size_t length, bool nonblock) {
+    u64 sleep_ns;
+    atomic_inc(&caximem_dev->send_wait);
+    caximem_send_doorbell(caximem_dev, length);
+    if (!nonblock && caximem_dev->send_slots == 1) {
+        caximem_busy_poll(caximem_dev, &caximem_dev->send_wait, &caximem_dev->send_polled, caximem_send_reg_done);
+        sleep_ns = ktime_get_ns();
+        wait_event(caximem_dev->send_wq_head, caximem_send_idle(caximem_dev));
+        caximem_wakeup_account(caximem_dev, true, sleep_ns);
+    }
+}
+
+/**
+ * Shared files
+ *
+ * Opened with O_EXCL, the file owns the device as before. In the queue and
+ * ring modes the device can instead be opened by several files without
+ * O_EXCL. Their writes go to the one send queue. A writer first reserves a
+ * free slot without holding send_sem and only then takes send_sem to fill
+ * it, so a writer waiting for room never holds up the other files, and
+ * writers with a slot take send_sem in turn (a semaphore hands over to its
+ * first waiter) and are queued in arrival order. Every shared file has a recv
+ * ring of its own, and the recv work copies each received frame into all of
+ * them. A file whose ring is full loses the frame, so one slow reader does
+ * not stall the others.
+ *
+ * With split_nodes the files of the <name>_<id>_tx and <name>_<id>_rx nodes
+ * own one direction each, and O_EXCL only excludes the other files owning
+ * the same direction. A sender and a receiver process then open and close
+ * their direction without resetting the other one.
+ */
+
+/**
+ * @brief hand the frames in the recv ring of the device to every shared file
+ *
+ * @param caximem_dev The caximem device, called from the recv work
+ */
+static void caximem_recv_fanout(struct caximem_device *caximem_dev) {
+    struct caximem_file *ctx;
+    size_t size;
+    void *slot;
+    down_read(&caximem_dev->files_sem);
+    while (!caximem_ring_empty(&caximem_dev->recv_ring)) {
+        slot = caximem_ring_tail(&caximem_dev->recv_ring, &size);
+        list_for_each_entry(ctx, &caximem_dev->files, node) {
+            if (!ctx->shared || !(ctx->dirs & CAXIMEM_FILE_RECV)) {
+                continue;
+            }
+            if (caximem_ring_full(&ctx->recv_ring)) {
+                atomic64_inc(&ctx->stats.recv_dropped);
+                continue;
+            }
+            memcpy(caximem_ring_head(&ctx->recv_ring), slot, size);
+            caximem_ring_push(&ctx->recv_ring, size);
+        }
+        caximem_ring_pop(&caximem_dev->recv_ring);
+    }
+    up_read(&caximem_dev->files_sem);
+}
+
+// Check if the recv ring has room for a frame, shared files take its frames first
+static bool caximem_recv_room(struct caximem_device *caximem_dev) {
+    if (READ_ONCE(caximem_dev->recv_shared)) {
+        caximem_recv_fanout(caximem_dev);
+    }
+    return !caximem_ring_full(&caximem_dev->recv_ring);
+}
+
+/**
+ * Batch mode
+ *
+ * With batch_frames the send work packs queued writes into one frame as
+ * caximem_batch_rec records, until batch_frames records are packed or the
+ * next one does not fit into the send slot. While the send window is free a
+ * partial batch is held back for at most batch_us, so a burst of small writes
+ * shares one handshake and one send interrupt. The recv work splits each
+ * frame back into the recv ring, one message per slot, and only re-arms the
+ * window once every message of the frame is in the ring.
+ */
+
+static enum hrtimer_restart caximem_batch_timer(struct hrtimer *timer) {
     struct caximem_device *caximem_dev;
-    int rc;
-    int atomic_store;
-    p = *offset;
-    caximem_dev = (struct caximem_device *)file->private_data;
-    down(&caximem_dev->recv_sem);
-    if (p > caximem_dev->recv_max_size) {
-        caximem_err("Invalid offset.\n");
-        rc = length == 0 ? 0 : -ENXIO;
-        goto up_sem;
+    caximem_dev = container_of(timer, struct caximem_device, batch_timer);
+    atomic_set(&caximem_dev->batch_flush, 1);
+    queue_work(system_highpri_wq, &caximem_dev->send_work);
+    return HRTIMER_NORESTART;
+}
+
+/**
+ * @brief check if the queued writes should be sent now, or start the batch timer
+ *
+ * @param caximem_dev The caximem device, called from the send work
+ * @return bool Returns true if the batch is full or its time is up
+ */
+static bool caximem_batch_ready(struct caximem_device *caximem_dev) {
+    struct caximem_ring *queue = &caximem_dev->send_queue;
+    unsigned int count, i;
+    size_t space, end, length;
+    count = caximem_ring_count(queue);
+    if (count >= caximem_dev->batch_frames || caximem_dev->batch_us == 0 || atomic_read(&caximem_dev->batch_flush)) {
+        return true;
+    }
+    space = caximem_dev->send_slot_size - sizeof(caximem_ctrl_t);
+    end = 0;
+    for (i = 0; i < count; i++) {
+        caximem_ring_peek(queue, i, &length);
+        end = ALIGN(end, CAXIMEM_BATCH_ALIGN) + sizeof(struct caximem_batch_rec) + length;
+    }
+    // No further record fits into the send slot
+    if (ALIGN(end, CAXIMEM_BATCH_ALIGN) + sizeof(struct caximem_batch_rec) >= space) {
+        return true;
+    }
+    if (!hrtimer_active(&caximem_dev->batch_timer)) {
+        hrtimer_start(&caximem_dev->batch_timer, ns_to_ktime((u64)caximem_dev->batch_us * NSEC_PER_USEC),
+                      HRTIMER_MODE_REL);
+    }
+    return false;
+}
+
+/**
+ * @brief pack the oldest queued writes into the send slot filled next
+ *
+ * @param caximem_dev The caximem device, called from the send work
+ * @return size_t Returns the size of the frame
+ */
+static size_t caximem_send_batch(struct caximem_device *caximem_dev) {
+    struct caximem_ring *queue = &caximem_dev->send_queue;
+    struct caximem_batch_rec rec;
+    struct kvec kvec[2];
+    struct iov_iter iter;
+    size_t space, offset, end, length;
+    unsigned int count;
+    space = caximem_dev->send_slot_size - sizeof(caximem_ctrl_t);
+    offset = 0;
+    end = 0;
+    for (count = 0; count < caximem_dev->batch_frames && !caximem_ring_empty(queue); count++) {
+        kvec[1].iov_base = caximem_ring_tail(queue, &length);
+        if (offset + sizeof(rec) + length > space) {
+            break;
+        }
+        rec.len = length;
+        kvec[0].iov_base = &rec;
+        kvec[0].iov_len = sizeof(rec);
+        kvec[1].iov_len = length;
+        iov_iter_kvec(&iter, WRITE, kvec, 2, sizeof(rec) + length);
+        caximem_copy_to_window(caximem_dev, &iter, offset, sizeof(rec) + length);
+        caximem_ring_pop(queue);
+        end = offset + sizeof(rec) + length;
+        offset = ALIGN(end, CAXIMEM_BATCH_ALIGN);
+    }
+    atomic64_add(count, &caximem_dev->stats.send_records);
+    atomic_set(&caximem_dev->batch_flush, 0);
+    hrtimer_try_to_cancel(&caximem_dev->batch_timer);
+    return end;
+}
+
+/**
+ * @brief split the batch in the recv window into the recv ring
+ *
+ * @param caximem_dev The caximem device, called from the recv work
+ * @param size The size of the frame in the recv window
+ * @return bool Returns true once every message is in the ring, false if the ring is full
+ */
+static bool caximem_recv_batch(struct caximem_device *caximem_dev, size_t size) {
+    struct caximem_batch_rec rec;
+    struct kvec kvec;
+    struct iov_iter iter;
+    size_t offset, length;
+    offset = caximem_dev->recv_batch_offset;
+    while (offset + sizeof(rec) <= size) {
+        if (!caximem_recv_room(caximem_dev)) {
+            caximem_dev->recv_batch_offset = offset;
+            return false;
+        }
+        memcpy_fromio(&rec, (char *)caximem_dev->recv_buffer + sizeof(caximem_ctrl_t) + offset, sizeof(rec));
+        offset += sizeof(rec);
+        length = min_t(size_t, rec.len, size - offset);
+        kvec.iov_base = caximem_ring_head(&caximem_dev->recv_ring);
+        kvec.iov_len = length;
+        iov_iter_kvec(&iter, READ, &kvec, 1, length);
+        caximem_copy_from_window(caximem_dev, &iter, offset, length);
+        caximem_ring_push(&caximem_dev->recv_ring, length);
+        atomic64_inc(&caximem_dev->stats.recv_records);
+        offset = ALIGN(offset + length, CAXIMEM_BATCH_ALIGN);
+        wake_up(&caximem_dev->recv_wq_head);
+    }
+    caximem_dev->recv_batch_offset = 0;
+    return true;
+}
+
+/**
+ * @brief feed the oldest queued frames into the free send slots
+ *
+ * The send interrupt frees a slot and queues this work again, so frames
+ * go out back-to-back without the writer waiting for each interrupt.
+ *
+ * @param work The send_work of the caximem device
+ */
+static void caximem_send_work(struct work_struct *work) {
+    struct caximem_device *caximem_dev;
+    size_t length;
+    struct kvec kvec;
+    struct iov_iter iter;
+    caximem_dev = container_of(work, struct caximem_device, send_work);
+    // CAXIMEM_CANCEL stores 1, the queued frames are dropped once
+    if (atomic_cmpxchg(&caximem_dev->send_discard, 1, 2) == 1) {
+        while (!caximem_ring_empty(&caximem_dev->send_queue)) {
+            caximem_ring_pop(&caximem_dev->send_queue);
+        }
+        wake_up(&caximem_dev->send_wq_head);
+    }
+    // Reset the slots after the PL has sent the frames it was handed, their interrupts requeue this work
+    if (atomic_read(&caximem_dev->send_discard)) {
+        if (atomic_read(&caximem_dev->send_busy)) {
+            return;
+        }
+        caximem_send_reset(caximem_dev);
+        atomic_set(&caximem_dev->send_discard, 0);
     }
+    while (READ_ONCE(caximem_dev->send_active) && atomic_read(&caximem_dev->send_busy) < caximem_dev->send_slots &&
+           !caximem_ring_empty(&caximem_dev->send_queue)) {
+        if (caximem_dev->batch_frames) {
+            if (!caximem_batch_ready(caximem_dev)) {
+                break;
+            }
+            length = caximem_send_batch(caximem_dev);
+        } else {
+            kvec.iov_base = caximem_ring_tail(&caximem_dev->send_queue, &length);
+            kvec.iov_len = length;
+            iov_iter_kvec(&iter, WRITE, &kvec, 1, length);
+            caximem_copy_to_window(caximem_dev, &iter, 0, length);
+            caximem_ring_pop(&caximem_dev->send_queue);
+        }
+        wake_up(&caximem_dev->send_wq_head);
+        // Mark busy before the doorbell, the interrupt may fire right after it
+        atomic_inc(&caximem_dev->send_busy);
+        caximem_send_doorbell(caximem_dev, length);
+    }
+}
+
+/**
+ * @brief queue a frame for sending without waiting for the PL
+ *
+ * @param caximem_dev The caximem device, send_sem must be held
+ * @param from The iterator of the frame data
+ * @param frag The fragment header put in front of the data, NULL for none
+ * @param length The number of bytes to write, already limited to the window
+ * @param nonblock Return -EAGAIN instead of waiting for a free slot
+ * @return ssize_t Returns the number of bytes queued, or error code less than 0 for errors
+ */
+static ssize_t caximem_write_queue(struct caximem_device *caximem_dev, struct iov_iter *from,
+                                   const struct caximem_frag_hdr *frag, size_t length, bool nonblock) {
+    char *slot;
+    size_t offset;
+    if (caximem_ring_full(&caximem_dev->send_queue)) {
+        if (nonblock) {
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(caximem_dev->send_wq_head, !caximem_ring_full(&caximem_dev->send_queue))) {
+            return -ERESTARTSYS;
+        }
+    }
+    slot = caximem_ring_head(&caximem_dev->send_queue);
+    offset = 0;
+    if (frag) {
+        memcpy(slot, frag, sizeof(*frag));
+        offset = sizeof(*frag);
+    }
+    if (copy_from_iter(slot + offset, length, from) != length) {
+        caximem_err("Write buffer failed.\n");
+        return -EFAULT;
+    }
+    caximem_ring_push(&caximem_dev->send_queue, offset + length);
+    queue_work(system_highpri_wq, &caximem_dev->send_work);
+    return length;
+}
+
+/**
+ * @brief arm the recv window so that the PL can store the next frame in it
+ *
+ * @param caximem_dev The caximem device
+ */
+static void caximem_recv_arm(struct caximem_device *caximem_dev) {
     caximem_dev->recv_info.size = 0;
     caximem_dev->recv_info.enable = true;
     caximem_ctrl_set(caximem_dev->recv_info_reg, &caximem_dev->recv_info);
-    atomic_store = atomic_read(&caximem_dev->recv_wait);
-    atomic_inc(&caximem_dev->recv_wait);
-    wait_event(caximem_dev->recv_wq_head, atomic_read(&caximem_dev->recv_wait) == atomic_store);
-    caximem_ctrl_get(caximem_dev->recv_info_reg, &caximem_dev->recv_info);
-    length = caximem_dev->recv_info.size > length ? length : caximem_dev->recv_info.size;
-    if (copy_to_user(buffer, (char *)caximem_dev->recv_buffer + sizeof(caximem_ctrl_t), length)) {
-        caximem_err("Read buffer failed.\n");
-        rc = -EFAULT;
-    } else {
-        caximem_debug("read %d bytes from %ld.\n", length, p);
-        rc = length;
+    if (caximem_dev->sim) {
+        caximem_sim_doorbell(caximem_dev, false);
     }
+}
+
+/**
+ * @brief disarm the recv window, the frame stays in the window until it is armed again
+ *
+ * @param caximem_dev The caximem device
+ */
+void caximem_recv_disarm(struct caximem_device *caximem_dev) {
+    caximem_dev->recv_armed = false;
     caximem_dev->recv_info.size = 0;
     caximem_dev->recv_info.enable = false;
     caximem_ctrl_set(caximem_dev->recv_info_reg, &caximem_dev->recv_info);
-up_sem:
-    up(&caximem_dev->recv_sem);
-    return rc;
 }
 
 /**
- * @brief read data to character device
+ * @brief arm the recv window unless it is armed already
+ *
+ * The window stays armed until the frame is consumed, so a frame may arrive
+ * while nobody is blocked in read (e.g. after poll).
+ *
+ * @param caximem_dev The caximem device, recv_sem must be held
+ */
+static void caximem_recv_start(struct caximem_device *caximem_dev) {
+    if (caximem_dev->recv_armed) {
+        return;
+    }
+    atomic_set(&caximem_dev->recv_wait, 1);
+    caximem_dev->recv_armed = true;
+    caximem_recv_arm(caximem_dev);
+}
+
+/**
+ * @brief arm the recv window and wait until the PL has stored a frame in it
+ *
+ * @param caximem_dev The caximem device, recv_sem must be held
+ * @param nonblock Return -EAGAIN instead of waiting, the window stays armed
+ * @param size Returns the number of bytes stored after the control header
+ * @return int Returns 0, or -EAGAIN
+ */
+int caximem_recv_locked(struct caximem_device *caximem_dev, bool nonblock, size_t *size) {
+    u64 sleep_ns;
+    caximem_recv_start(caximem_dev);
+    if (!caximem_recv_ready(caximem_dev)) {
+        if (nonblock) {
+            return -EAGAIN;
+        }
+        caximem_busy_poll(caximem_dev, &caximem_dev->recv_wait, &caximem_dev->recv_polled, caximem_recv_reg_done);
+        sleep_ns = ktime_get_ns();
+        wait_event(caximem_dev->recv_wq_head, caximem_recv_ready(caximem_dev));
+        caximem_wakeup_account(caximem_dev, false, sleep_ns);
+    }
+    caximem_ctrl_get(caximem_dev->recv_info_reg, &caximem_dev->recv_info);
+    *size = min_t(size_t, caximem_dev->recv_info.size, caximem_dev->recv_max_size - sizeof(caximem_ctrl_t));
+    atomic64_inc(&caximem_dev->stats.recv_frames);
+    atomic64_add(*size, &caximem_dev->stats.recv_bytes);
+    return 0;
+}
+
+/**
+ * @brief move the frame in the recv window into the recv ring and re-arm receive
+ *
+ * @param caximem_dev The caximem device, called from the recv work
+ * @return bool Returns true if the frame was taken, false if the ring is full
+ */
+static bool caximem_recv_drain(struct caximem_device *caximem_dev) {
+    size_t size;
+    struct kvec kvec;
+    struct iov_iter iter;
+    if (!caximem_recv_room(caximem_dev)) {
+        return false;
+    }
+    caximem_ctrl_get(caximem_dev->recv_info_reg, &caximem_dev->recv_info);
+    size = min_t(size_t, caximem_dev->recv_info.size, caximem_dev->recv_ring.slot_size);
+    if (caximem_dev->batch_frames) {
+        if (!caximem_recv_batch(caximem_dev, size)) {
+            return false;
+        }
+    } else {
+        kvec.iov_base = caximem_ring_head(&caximem_dev->recv_ring);
+        kvec.iov_len = size;
+        iov_iter_kvec(&iter, READ, &kvec, 1, size);
+        caximem_copy_from_window(caximem_dev, &iter, 0, size);
+        caximem_ring_push(&caximem_dev->recv_ring, size);
+    }
+    atomic64_inc(&caximem_dev->stats.recv_frames);
+    atomic64_add(size, &caximem_dev->stats.recv_bytes);
+    caximem_recv_disarm(caximem_dev);
+    caximem_recv_arm(caximem_dev);
+    if (READ_ONCE(caximem_dev->recv_shared)) {
+        caximem_recv_fanout(caximem_dev);
+    }
+    wake_up(&caximem_dev->recv_wq_head);
+    caximem_event_signal(caximem_dev, false);
+    return true;
+}
+
+/**
+ * Receive polling
+ *
+ * With recv_poll_budget the recv interrupt only starts polling: the handler
+ * masks recv_signal and the recv work takes frames by watching
+ * recv_info_reg. After recv_poll_budget frames the work queues itself again
+ * so other work gets the CPU, and once no frame has arrived for recv_poll_us
+ * the interrupt is unmasked. Under load the frames then cost neither an
+ * interrupt nor a work item each. A full ring keeps the interrupt masked
+ * until a reader frees a slot.
+ */
+
+/**
+ * @brief take frames from the recv window without the interrupt until the link goes quiet
+ *
+ * @param caximem_dev The caximem device, called from the recv work
+ */
+static void caximem_recv_poll(struct caximem_device *caximem_dev) {
+    unsigned int done;
+    u64 idle;
+    if (!atomic_read(&caximem_dev->recv_polling)) {
+        // Queued again after the interrupt was unmasked
+        return;
+    }
+    done = 0;
+    idle = ktime_get_ns();
+    while (READ_ONCE(caximem_dev->recv_active)) {
+        if (caximem_recv_reg_done(caximem_dev)) {
+            if (!caximem_recv_drain(caximem_dev)) {
+                return;
+            }
+            if (++done >= caximem_dev->recv_poll_budget) {
+                queue_work(system_highpri_wq, &caximem_dev->recv_work);
+                return;
+            }
+            idle = ktime_get_ns();
+            continue;
+        }
+        if (ktime_get_ns() - idle >= (u64)caximem_dev->recv_poll_us * NSEC_PER_USEC) {
+            break;
+        }
+        cond_resched();
+        cpu_relax();
+    }
+    if (atomic_xchg(&caximem_dev->recv_polling, 0)) {
+        caximem_recv_irq_mask(caximem_dev, false);
+        // A frame stored before the unmask raised no interrupt
+        if (READ_ONCE(caximem_dev->recv_active) && caximem_recv_reg_done(caximem_dev)) {
+            caximem_recv_poll_start(caximem_dev);
+        }
+    }
+}
+
+/**
+ * @brief move frames from the recv window into the recv ring and re-arm receive
+ *
+ * Receive stays disarmed while the ring is full, so the PL holds the frame
+ * until a reader frees a slot and queues this work again.
+ *
+ * @param work The recv_work of the caximem device
+ */
+static void caximem_recv_work(struct work_struct *work) {
+    struct caximem_device *caximem_dev;
+    caximem_dev = container_of(work, struct caximem_device, recv_work);
+    if (caximem_dev->recv_poll_budget) {
+        caximem_recv_poll(caximem_dev);
+        return;
+    }
+    while (atomic_read(&caximem_dev->recv_pending) > 0 && READ_ONCE(caximem_dev->recv_active)) {
+        if (!caximem_recv_drain(caximem_dev)) {
+            break;
+        }
+        atomic_dec(&caximem_dev->recv_pending);
+    }
+}
+
+// Let the recv work go on after a reader freed a ring slot
+static void caximem_recv_resume(struct caximem_device *caximem_dev) {
+    if (atomic_read(&caximem_dev->recv_pending) > 0 || atomic_read(&caximem_dev->recv_polling)) {
+        queue_work(system_highpri_wq, &caximem_dev->recv_work);
+    }
+}
+
+/**
+ * @brief read the oldest frame from the recv ring
+ *
+ * @param caximem_dev The caximem device
+ * @param ring The recv ring of the device, or of a shared file
+ * @param recv_cancel The cancel counter of the ring
+ * @param to The iterator to store the frame data
+ * @param nonblock Return -EAGAIN instead of waiting for a frame
+ * @param frame Returns the length of the frame before truncation
+ * @return ssize_t Returns the number of bytes read, 0 if canceled, or error code less than 0 for errors
+ */
+static ssize_t caximem_read_ring(struct caximem_device *caximem_dev, struct caximem_ring *ring, atomic_t *recv_cancel,
+                                 struct iov_iter *to, bool nonblock, size_t *frame) {
+    int cancel;
+    size_t size, length;
+    void *slot;
+    ssize_t rc;
+    u64 sleep_ns;
+    cancel = atomic_read(recv_cancel);
+    if (nonblock && caximem_ring_empty(ring)) {
+        return -EAGAIN;
+    }
+    sleep_ns = ktime_get_ns();
+    if (wait_event_interruptible(caximem_dev->recv_wq_head,
+                                 !caximem_ring_empty(ring) || atomic_read(recv_cancel) != cancel)) {
+        return -ERESTARTSYS;
+    }
+    caximem_wakeup_account(caximem_dev, false, sleep_ns);
+    if (caximem_ring_empty(ring)) {
+        *frame = 0;
+        return 0;
+    }
+    slot = caximem_ring_tail(ring, &size);
+    *frame = size;
+    length = min(size, iov_iter_count(to));
+    if (length < size) {
+        atomic64_inc(&caximem_dev->stats.recv_short);
+    }
+    if (copy_to_iter(slot, length, to) != length) {
+        caximem_err("Read buffer failed.\n");
+        rc = -EFAULT;
+    } else {
+        rc = length;
+    }
+    caximem_ring_pop(ring);
+    caximem_recv_resume(caximem_dev);
+    return rc;
+}
+
+/**
+ * Message mode
+ *
+ * With msg_max_size every frame carries a caximem_frag_hdr after the control
+ * header. A write is split into as many frames as the send slots need, the
+ * first one flagged CAXIMEM_FRAG_FIRST and the last one CAXIMEM_FRAG_LAST.
+ * Only the first fragment honours nonblock, the following fragments are
+ * copied into the next free slot or queue slot while the PL still sends the
+ * previous ones. A read gathers the fragments of one message straight into
+ * the user buffers. Fragments before the first FIRST are skipped, and a FIRST
+ * in the middle of a message drops the incomplete message.
+ */
+
+/**
+ * @brief copy payload of the fragment returned by caximem_frag_next and consume it
+ *
+ * @param caximem_dev The caximem device, recv_sem must be held
+ * @param to The iterator to store the payload, NULL to drop the fragment
+ * @param length The number of payload bytes to copy
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+static int caximem_frag_done(struct caximem_device *caximem_dev, struct iov_iter *to, size_t length) {
+    struct caximem_ring *ring = &caximem_dev->recv_ring;
+    size_t size;
+    char *slot;
+    int rc = 0;
+    if (caximem_dev->recv_ring_slots) {
+        slot = caximem_ring_tail(ring, &size);
+        if (to && length && copy_to_iter(slot + sizeof(struct caximem_frag_hdr), length, to) != length) {
+            rc = -EFAULT;
+        }
+        caximem_ring_pop(ring);
+        caximem_recv_resume(caximem_dev);
+    } else {
+        if (to && length && caximem_copy_from_window(caximem_dev, to, sizeof(struct caximem_frag_hdr), length) < 0) {
+            rc = -EFAULT;
+        }
+        caximem_recv_disarm(caximem_dev);
+    }
+    if (rc < 0) {
+        caximem_err("Read buffer failed.\n");
+    }
+    return rc;
+}
+
+/**
+ * @brief wait for the next fragment and get its header
+ *
+ * Frames too short for a fragment header are dropped.
+ *
+ * @param caximem_dev The caximem device, recv_sem must be held
+ * @param nonblock Return -EAGAIN instead of waiting for a fragment
+ * @param cancel The value of recv_cancel when the read started
+ * @param frag Returns the fragment header
+ * @param size Returns the number of payload bytes after the fragment header
+ * @return int Returns 0, 1 if canceled, or error code less than 0 for errors
+ */
+static int caximem_frag_next(struct caximem_device *caximem_dev, bool nonblock, int cancel,
+                             struct caximem_frag_hdr *frag, size_t *size) {
+    struct caximem_ring *ring = &caximem_dev->recv_ring;
+    u64 sleep_ns;
+    int rc;
+    for (;;) {
+        if (caximem_dev->recv_ring_slots) {
+            if (caximem_ring_empty(ring)) {
+                if (nonblock) {
+                    return -EAGAIN;
+                }
+                sleep_ns = ktime_get_ns();
+                if (wait_event_interruptible(caximem_dev->recv_wq_head,
+                                             !caximem_ring_empty(ring) ||
+                                                 atomic_read(&caximem_dev->recv_cancel) != cancel)) {
+                    return -ERESTARTSYS;
+                }
+                caximem_wakeup_account(caximem_dev, false, sleep_ns);
+                if (caximem_ring_empty(ring)) {
+                    return 1;
+                }
+            }
+            memcpy(frag, caximem_ring_tail(ring, size), min(*size, sizeof(*frag)));
+        } else {
+            rc = caximem_recv_locked(caximem_dev, nonblock, size);
+            if (rc < 0) {
+                return rc;
+            }
+            if (*size == 0) {
+                // An armed window reads as an empty frame after cancel
+                caximem_recv_disarm(caximem_dev);
+                return 1;
+            }
+            memcpy_fromio(frag, (char *)caximem_dev->recv_buffer + sizeof(caximem_ctrl_t), min(*size, sizeof(*frag)));
+        }
+        if (*size >= sizeof(*frag)) {
+            *size -= sizeof(*frag);
+            return 0;
+        }
+        caximem_frag_done(caximem_dev, NULL, 0);
+    }
+}
+
+/**
+ * @brief read one message, reassembling its fragments into the iterator
+ *
+ * @param caximem_dev The caximem device, recv_sem must be held
+ * @param to The iterator to store the message
+ * @param nonblock Return -EAGAIN instead of waiting for the first fragment
+ * @param frame Returns the length of the message before truncation
+ * @return ssize_t Returns the number of bytes read, 0 if canceled, or error code less than 0 for errors
+ */
+static ssize_t caximem_read_msg(struct caximem_device *caximem_dev, struct iov_iter *to, bool nonblock, size_t *frame) {
+    struct caximem_frag_hdr frag;
+    size_t size, length, copied;
+    bool started;
+    int cancel;
+    int rc;
+    cancel = atomic_read(&caximem_dev->recv_cancel);
+    started = false;
+    copied = 0;
+    *frame = 0;
+    for (;;) {
+        rc = caximem_frag_next(caximem_dev, nonblock && !started, cancel, &frag, &size);
+        if (rc < 0) {
+            return rc;
+        }
+        if (rc > 0) {
+            iov_iter_revert(to, copied);
+            *frame = 0;
+            return 0;
+        }
+        if (frag.flags & CAXIMEM_FRAG_FIRST) {
+            if (started) {
+                atomic64_inc(&caximem_dev->stats.recv_dropped);
+                iov_iter_revert(to, copied);
+            }
+            started = true;
+            copied = 0;
+            *frame = frag.msg_len;
+        } else if (!started) {
+            // The rest of a message we have not seen the start of
+            caximem_frag_done(caximem_dev, NULL, 0);
+            continue;
+        }
+        length = min(size, iov_iter_count(to));
+        rc = caximem_frag_done(caximem_dev, to, length);
+        if (rc < 0) {
+            return rc;
+        }
+        copied += length;
+        if (frag.flags & CAXIMEM_FRAG_LAST) {
+            break;
+        }
+    }
+    if (copied < *frame) {
+        atomic64_inc(&caximem_dev->stats.recv_short);
+    }
+    return copied;
+}
+
+/**
+ * @brief write one message, splitting it into fragments that fit the send slots
+ *
+ * @param caximem_dev The caximem device, send_sem must be held
+ * @param from The iterator of the message
+ * @param nonblock Return -EAGAIN instead of waiting for the first fragment
+ * @return ssize_t Returns the number of bytes written, or error code less than 0 for errors
+ */
+static ssize_t caximem_write_msg(struct caximem_device *caximem_dev, struct iov_iter *from, bool nonblock) {
+    struct caximem_frag_hdr frag;
+    size_t total, chunk, max;
+    ssize_t rc;
+    total = iov_iter_count(from);
+    if (total > caximem_dev->msg_max_size) {
+        return -EMSGSIZE;
+    }
+    max = caximem_dev->send_slot_size - sizeof(caximem_ctrl_t) - sizeof(frag);
+    frag.flags = CAXIMEM_FRAG_FIRST;
+    frag.msg_len = total;
+    do {
+        chunk = min(iov_iter_count(from), max);
+        if (chunk == iov_iter_count(from)) {
+            frag.flags |= CAXIMEM_FRAG_LAST;
+        }
+        if (caximem_dev->send_queue_slots) {
+            rc = caximem_write_queue(caximem_dev, from, &frag, chunk, nonblock);
+            if (rc < 0) {
+                return rc;
+            }
+        } else {
+            rc = caximem_send_wait_idle(caximem_dev, nonblock);
+            if (rc < 0) {
+                return rc;
+            }
+            memcpy_toio((char *)caximem_dev->send_info_reg + sizeof(caximem_ctrl_t), &frag, sizeof(frag));
+            if (caximem_copy_to_window(caximem_dev, from, sizeof(frag), chunk) < 0) {
+                caximem_err("Write buffer failed.\n");
+                return -EFAULT;
+            }
+            // Only wait for the PL after the last fragment
+            caximem_send_locked(caximem_dev, sizeof(frag) + chunk, nonblock || !(frag.flags & CAXIMEM_FRAG_LAST));
+        }
+        nonblock = false;
+        frag.flags = 0;
+    } while (iov_iter_count(from));
+    return total;
+}
+
+/**
+ * @brief read one frame, scattering it over the iterator
+ *
+ * @param caximem_dev The caximem device, recv_sem must be held
+ * @param to The iterator to store the frame data
+ * @param nonblock Return -EAGAIN instead of waiting for a frame
+ * @param frame Returns the length of the frame before truncation
+ * @return ssize_t Returns the number of bytes read, or error code less than 0 for errors
+ */
+static ssize_t caximem_read_locked(struct caximem_device *caximem_dev, struct iov_iter *to, bool nonblock, size_t *frame) {
+    ssize_t rc;
+    size_t size, length;
+    if (caximem_dev->uring.active) {
+        return -EBUSY;
+    }
+    if (caximem_dev->msg_max_size) {
+        return caximem_read_msg(caximem_dev, to, nonblock, frame);
+    }
+    if (caximem_dev->recv_ring_slots) {
+        return caximem_read_ring(caximem_dev, &caximem_dev->recv_ring, &caximem_dev->recv_cancel, to, nonblock, frame);
+    }
+    rc = caximem_recv_locked(caximem_dev, nonblock, &size);
+    if (rc < 0) {
+        return rc;
+    }
+    *frame = size;
+    length = min(size, iov_iter_count(to));
+    if (length < size) {
+        atomic64_inc(&caximem_dev->stats.recv_short);
+    }
+    if (caximem_copy_from_window(caximem_dev, to, 0, length) < 0) {
+        caximem_err("Read buffer failed.\n");
+        rc = -EFAULT;
+    } else {
+        rc = length;
+    }
+    caximem_recv_disarm(caximem_dev);
+    return rc;
+}
+
+/**
+ * @brief write one frame, gathering it from the iterator
+ *
+ * @param caximem_dev The caximem device, send_sem must be held
+ * @param from The iterator of the frame data, truncated to the send window
+ * @param nonblock Return -EAGAIN instead of waiting for the PL
+ * @return ssize_t Returns the number of bytes written, or error code less than 0 for errors
+ */
+static ssize_t caximem_write_locked(struct caximem_device *caximem_dev, struct iov_iter *from, bool nonblock) {
+    ssize_t rc;
+    size_t length, max;
+    length = iov_iter_count(from);
+    trace_caximem_write_start(caximem_dev->dev_id, length);
+    if (caximem_dev->uring.active) {
+        return -EBUSY;
+    }
+    if (caximem_dev->msg_max_size) {
+        return caximem_write_msg(caximem_dev, from, nonblock);
+    }
+    max = caximem_dev->send_slot_size - sizeof(caximem_ctrl_t);
+    if (caximem_dev->batch_frames) {
+        max -= sizeof(struct caximem_batch_rec);
+    }
+    if (length > max) {
+        length = max;
+        atomic64_inc(&caximem_dev->stats.send_truncated);
+    }
+    if (caximem_dev->send_queue_slots) {
+        return caximem_write_queue(caximem_dev, from, NULL, length, nonblock);
+    }
+    rc = caximem_send_wait_idle(caximem_dev, nonblock);
+    if (rc < 0) {
+        return rc;
+    }
+    if (caximem_copy_to_window(caximem_dev, from, 0, length) < 0) {
+        caximem_err("Write buffer failed.\n");
+        return -EFAULT;
+    }
+    caximem_send_locked(caximem_dev, length, nonblock);
+    return length;
+}
+
+// Get the semaphore serializing the readers of a file
+static struct semaphore *caximem_file_recv_sem(struct caximem_file *ctx) {
+    return ctx->shared ? &ctx->recv_sem : &ctx->dev->recv_sem;
+}
+
+// Check if a send queue slot is neither filled nor reserved, send_reserve_lock must be held
+static bool caximem_send_free(struct caximem_device *caximem_dev) {
+    return caximem_ring_count(&caximem_dev->send_queue) + caximem_dev->send_reserved < caximem_dev->send_queue.slots;
+}
+
+// Reserve a free slot of the send queue, the slots are freed by the send work
+static bool caximem_send_reserve(struct caximem_device *caximem_dev) {
+    bool reserved;
+    spin_lock(&caximem_dev->send_reserve_lock);
+    reserved = caximem_send_free(caximem_dev);
+    if (reserved) {
+        caximem_dev->send_reserved++;
+    }
+    spin_unlock(&caximem_dev->send_reserve_lock);
+    return reserved;
+}
+
+// Drop a reservation, after its frame is pushed or the write failed
+static void caximem_send_unreserve(struct caximem_device *caximem_dev) {
+    spin_lock(&caximem_dev->send_reserve_lock);
+    caximem_dev->send_reserved--;
+    spin_unlock(&caximem_dev->send_reserve_lock);
+    // A pushed frame was counted twice until now, recheck the waiting writers
+    wake_up(&caximem_dev->send_wq_head);
+}
+
+/**
+ * @brief take send_sem to write one frame through a file
+ *
+ * A shared file reserves its queue slot before taking send_sem, a full queue
+ * is waited for without holding it.
+ *
+ * @param ctx The file context
+ * @param nonblock Return -EAGAIN instead of waiting
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+static int caximem_file_send_lock(struct caximem_file *ctx, bool nonblock) {
+    struct caximem_device *caximem_dev = ctx->dev;
+    if (ctx->shared) {
+        if (nonblock && !caximem_send_reserve(caximem_dev)) {
+            return -EAGAIN;
+        }
+        if (!nonblock && wait_event_interruptible(caximem_dev->send_wq_head, caximem_send_reserve(caximem_dev))) {
+            return -ERESTARTSYS;
+        }
+        atomic_inc(&ctx->send_reserved);
+    }
+    if (nonblock) {
+        if (down_trylock(&caximem_dev->send_sem)) {
+            if (ctx->shared) {
+                atomic_dec(&ctx->send_reserved);
+                caximem_send_unreserve(caximem_dev);
+            }
+            return -EAGAIN;
+        }
+    } else {
+        down(&caximem_dev->send_sem);
+    }
+    return 0;
+}
+
+// Release send_sem and the reservation taken by caximem_file_send_lock
+static void caximem_file_send_unlock(struct caximem_file *ctx) {
+    if (ctx->shared) {
+        // The frames of the file are queued before this head, see caximem_file_send_done
+        WRITE_ONCE(ctx->send_head, ctx->dev->send_queue.head);
+    }
+    up(&ctx->dev->send_sem);
+    if (ctx->shared) {
+        atomic_dec(&ctx->send_reserved);
+        caximem_send_unreserve(ctx->dev);
+    }
+}
+
+// Check if the frames written through a shared file have left the send queue
+static bool caximem_file_send_done(struct caximem_file *ctx) {
+    struct caximem_ring *queue = &ctx->dev->send_queue;
+    unsigned int queued;
+    if (atomic_read(&ctx->send_reserved)) {
+        return false;
+    }
+    // The queue holds at most slots frames, a larger distance means the tail has passed send_head
+    queued = READ_ONCE(ctx->send_head) - READ_ONCE(queue->tail);
+    return queued == 0 || queued > queue->slots;
+}
+
+/**
+ * @brief read one frame through a file, a shared file reads from its own recv ring
+ *
+ * @param ctx The file context, the semaphore of caximem_file_recv_sem must be held
+ * @param to The iterator to store the frame data
+ * @param nonblock Return -EAGAIN instead of waiting for a frame
+ * @param frame Returns the length of the frame before truncation
+ * @return ssize_t Returns the number of bytes read, or error code less than 0 for errors
+ */
+static ssize_t caximem_file_read(struct caximem_file *ctx, struct iov_iter *to, bool nonblock, size_t *frame) {
+    ssize_t rc;
+    if (!(ctx->dirs & CAXIMEM_FILE_RECV)) {
+        return -EBADF;
+    }
+    if (ctx->shared) {
+        rc = caximem_read_ring(ctx->dev, &ctx->recv_ring, &ctx->recv_cancel, to, nonblock, frame);
+    } else {
+        rc = caximem_read_locked(ctx->dev, to, nonblock, frame);
+    }
+    if (rc > 0) {
+        atomic64_inc(&ctx->stats.recv_frames);
+        atomic64_add(rc, &ctx->stats.recv_bytes);
+    }
+    return rc;
+}
+
+/**
+ * @brief write one frame through a file
+ *
+ * @param ctx The file context, send_sem must be held
+ * @param from The iterator of the frame data
+ * @param nonblock Return -EAGAIN instead of waiting for the PL
+ * @return ssize_t Returns the number of bytes written, or error code less than 0 for errors
+ */
+static ssize_t caximem_file_write(struct caximem_file *ctx, struct iov_iter *from, bool nonblock) {
+    ssize_t rc;
+    if (!(ctx->dirs & CAXIMEM_FILE_SEND)) {
+        return -EBADF;
+    }
+    rc = caximem_write_locked(ctx->dev, from, nonblock);
+    if (rc >= 0) {
+        atomic64_inc(&ctx->stats.send_frames);
+        atomic64_add(rc, &ctx->stats.send_bytes);
+    }
+    return rc;
+}
+
+/**
+ * File Operations
+ */
+
+/**
+ * @brief read data from character device, also serves readv, aio and io_uring
+ *
+ * @param iocb The kernel io control block of the request
+ * @param to The iterator of the user buffers
+ * @return ssize_t Returns the number of bytes read, or error code less than 0 for errors
+ */
+static ssize_t caximem_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    unsigned long p;
+    struct caximem_file *ctx;
+    struct caximem_device *caximem_dev;
+    struct semaphore *sem;
+    ssize_t rc;
+    size_t frame;
+    bool nonblock;
+    p = iocb->ki_pos;
+    ctx = (struct caximem_file *)iocb->ki_filp->private_data;
+    caximem_dev = ctx->dev;
+    sem = caximem_file_recv_sem(ctx);
+    nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    if (nonblock) {
+        if (down_trylock(sem)) {
+            return -EAGAIN;
+        }
+    } else {
+        down(sem);
+    }
+    if (p > caximem_dev->recv_max_size) {
+        caximem_err("Invalid offset.\n");
+        rc = iov_iter_count(to) == 0 ? 0 : -ENXIO;
+        goto up_sem;
+    }
+    rc = caximem_file_read(ctx, to, nonblock, &frame);
+up_sem:
+    up(sem);
+    return rc;
+}
+
+/**
+ * @brief write data to character device, also serves writev, aio and io_uring
+ *
+ * @param iocb  The kernel io control block of the request
+ * @param from  The iterator of the user buffers, gathered into one frame
+ * @return ssize_t  Returns the number of bytes written, or error code less than 0 for errors
+ */
+static ssize_t caximem_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    unsigned long p;
+    struct caximem_file *ctx;
+    struct caximem_device *caximem_dev;
+    ssize_t rc;
+    bool nonblock;
+    p = iocb->ki_pos;
+    ctx = (struct caximem_file *)iocb->ki_filp->private_data;
+    caximem_dev = ctx->dev;
+    nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    rc = caximem_file_send_lock(ctx, nonblock);
+    if (rc < 0) {
+        return rc;
+    }
+    if (p > caximem_dev->send_max_size) {
+        caximem_err("Invalid offset.\n");
+        rc = iov_iter_count(from) == 0 ? 0 : -ENXIO;
+        goto up_sem;
+    }
+    rc = caximem_file_write(ctx, from, nonblock);
+up_sem:
+    caximem_file_send_unlock(ctx);
+    return rc;
+}
+
+// Reset the send direction for its first file
+static void caximem_send_open(struct caximem_device *caximem_dev) {
+    atomic_set(&caximem_dev->send_wait, 0);
+    caximem_send_reset(caximem_dev);
+    atomic_set(&caximem_dev->send_polled, 0);
+    if (caximem_dev->send_queue_slots) {
+        caximem_ring_reset(&caximem_dev->send_queue);
+        atomic_set(&caximem_dev->send_busy, 0);
+        atomic_set(&caximem_dev->send_discard, 0);
+        atomic_set(&caximem_dev->batch_flush, 0);
+        WRITE_ONCE(caximem_dev->send_active, true);
+    }
+}
+
+// Reset and arm the recv direction for its first file
+static void caximem_recv_open(struct caximem_device *caximem_dev) {
+    atomic_set(&caximem_dev->recv_wait, 0);
+    atomic_set(&caximem_dev->recv_polled, 0);
+    caximem_dev->recv_armed = false;
+    if (caximem_dev->recv_ring_slots) {
+        caximem_ring_reset(&caximem_dev->recv_ring);
+        atomic_set(&caximem_dev->recv_pending, 0);
+        caximem_dev->recv_batch_offset = 0;
+        WRITE_ONCE(caximem_dev->recv_active, true);
+        caximem_recv_arm(caximem_dev);
+    }
+}
+
+// Stop the send direction after its last file
+static void caximem_send_close(struct caximem_device *caximem_dev) {
+    if (caximem_dev->send_queue_slots) {
+        WRITE_ONCE(caximem_dev->send_active, false);
+        cancel_work_sync(&caximem_dev->send_work);
+        if (caximem_dev->batch_frames) {
+            hrtimer_cancel(&caximem_dev->batch_timer);
+        }
+    }
+    atomic_set(&caximem_dev->send_wait, 0);
+    caximem_send_reset(caximem_dev);
+    caximem_set_eventfd(caximem_dev, &caximem_dev->send_eventfd, -1);
+}
+
+// Stop and disarm the recv direction after its last file
+static void caximem_recv_close(struct caximem_device *caximem_dev) {
+    if (caximem_dev->recv_ring_slots) {
+        WRITE_ONCE(caximem_dev->recv_active, false);
+        cancel_work_sync(&caximem_dev->recv_work);
+        if (atomic_xchg(&caximem_dev->recv_polling, 0)) {
+            caximem_recv_irq_mask(caximem_dev, false);
+        }
+    }
+    atomic_set(&caximem_dev->recv_wait, 0);
+    caximem_dev->recv_info.size = 0;
+    caximem_dev->recv_info.enable = false;
+    caximem_dev->recv_armed = false;
+    caximem_ctrl_set(caximem_dev->recv_info_reg, &caximem_dev->recv_info);
+    caximem_set_eventfd(caximem_dev, &caximem_dev->recv_eventfd, -1);
+}
+
+// Check if a direction cannot take another file, open files own it and shared of them are opened without O_EXCL
+static bool caximem_dir_busy(bool shared, unsigned int open, unsigned int open_shared) {
+    // An exclusive file excludes every other file owning the same direction
+    return (!shared && open) || open > open_shared;
+}
+
+/**
+ * @brief open the character device
+ *
+ * @param inode The inode structure pointer
+ * @param file The file structure pointer
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+static int caximem_open(struct inode *inode, struct file *file) {
+    struct caximem_device *caximem_dev;
+    struct caximem_file *ctx;
+    unsigned int dirs;
+    bool shared;
+    int rc;
+    caximem_dev = container_of(inode->i_cdev, struct caximem_device, chrdev);
+    if (caximem_dev->magic != CAXIMEM_MAGIC) {
+        caximem_err("caximem_dev 0x%p inode 0x%lx magic mismatch 0x%x.\n", caximem_dev, inode->i_ino, caximem_dev->magic);
+        return -EINVAL;
+    }
+    dirs = caximem_node_dirs[iminor(inode) - MINOR(caximem_dev->cdevno)];
+    shared = !(file->f_flags & O_EXCL);
+    if (!capable(CAP_SYS_ADMIN)) {
+        caximem_err("No permission.\n");
+        return -EACCES;
+    } else if (shared && (caximem_dev->msg_max_size || ((dirs & CAXIMEM_FILE_SEND) && !caximem_dev->send_queue_slots) ||
+                          ((dirs & CAXIMEM_FILE_RECV) && !caximem_dev->recv_ring_slots))) {
+        // Sharing needs the send queue and the recv ring to arbitrate and fan out the frames
+        caximem_err("Opening without O_EXCL needs send_queue_slots, recv_ring_slots and no msg_max_size.\n");
+        return -EINVAL;
+    }
+    ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+    if (ctx == NULL) {
+        return -ENOMEM;
+    }
+    ctx->dev = caximem_dev;
+    ctx->dirs = dirs;
+    ctx->shared = shared;
+    sema_init(&ctx->recv_sem, 1);
+    atomic_set(&ctx->recv_cancel, 0);
+    atomic_set(&ctx->send_reserved, 0);
+    if (shared && (dirs & CAXIMEM_FILE_RECV)) {
+        rc = caximem_ring_init(&ctx->recv_ring, caximem_dev->recv_ring_slots, caximem_dev->recv_ring.slot_size);
+        if (rc < 0) {
+            goto free_ctx;
+        }
+    }
+    down(&caximem_dev->file_sem);
+    if (((dirs & CAXIMEM_FILE_SEND) && caximem_dir_busy(shared, caximem_dev->send_open, caximem_dev->send_shared)) ||
+        ((dirs & CAXIMEM_FILE_RECV) && caximem_dir_busy(shared, caximem_dev->recv_open, caximem_dev->recv_shared))) {
+        caximem_err("Current device is busy.\n");
+        rc = -EBUSY;
+        goto up_sem;
+    }
+    if ((dirs & CAXIMEM_FILE_SEND) && !caximem_dev->send_open) {
+        caximem_send_open(caximem_dev);
+    }
+    // Nothing written through the file yet
+    ctx->send_head = READ_ONCE(caximem_dev->send_queue.head);
+    if ((dirs & CAXIMEM_FILE_RECV) && !caximem_dev->recv_open) {
+        caximem_recv_open(caximem_dev);
+    }
+    down_write(&caximem_dev->files_sem);
+    list_add_tail(&ctx->node, &caximem_dev->files);
+    caximem_dev->files_open++;
+    if (dirs & CAXIMEM_FILE_SEND) {
+        caximem_dev->send_open++;
+        caximem_dev->send_shared += shared;
+    }
+    if (dirs & CAXIMEM_FILE_RECV) {
+        caximem_dev->recv_open++;
+        caximem_dev->recv_shared += shared;
+    }
+    up_write(&caximem_dev->files_sem);
+    up(&caximem_dev->file_sem);
+    file->private_data = ctx;
+    // read_iter and write_iter honour IOCB_NOWAIT
+    file->f_mode |= FMODE_NOWAIT;
+    caximem_debug("open device, %s, dirs 0x%x\n", shared ? "shared" : "exclusive", dirs);
+    return 0;
+
+up_sem:
+    up(&caximem_dev->file_sem);
+    caximem_ring_free(&ctx->recv_ring);
+free_ctx:
+    kfree(ctx);
+    return rc;
+}
+
+/**
+ * @brief release the character device
+ *
+ * @param inode The inode structure pointer
+ * @param file The file structure pointer
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+static int caximem_release(struct inode *inode, struct file *file) {
+    struct caximem_device *caximem_dev;
+    struct caximem_file *ctx;
+    caximem_dev = container_of(inode->i_cdev, struct caximem_device, chrdev);
+    if (caximem_dev->magic != CAXIMEM_MAGIC) {
+        caximem_err("caximem_dev 0x%p inode 0x%lx magic mismatch 0x%x.\n", caximem_dev, inode->i_ino, caximem_dev->magic);
+        return -EINVAL;
+    }
+    ctx = (struct caximem_file *)file->private_data;
+    down(&caximem_dev->file_sem);
+    // After this the recv work no longer delivers frames to the file
+    down_write(&caximem_dev->files_sem);
+    list_del(&ctx->node);
+    caximem_dev->files_open--;
+    if (ctx->dirs & CAXIMEM_FILE_SEND) {
+        caximem_dev->send_open--;
+        caximem_dev->send_shared -= ctx->shared;
+    }
+    if (ctx->dirs & CAXIMEM_FILE_RECV) {
+        caximem_dev->recv_open--;
+        caximem_dev->recv_shared -= ctx->shared;
+    }
+    up_write(&caximem_dev->files_sem);
+    // The uring is only set up by a file owning both directions, stop it before either of them
+    if (!caximem_dev->files_open) {
+        caximem_uring_free(caximem_dev);
+    }
+    // The queued frames of a file are still sent while other files keep the direction running
+    if ((ctx->dirs & CAXIMEM_FILE_SEND) && !caximem_dev->send_open) {
+        caximem_send_close(caximem_dev);
+    }
+    if ((ctx->dirs & CAXIMEM_FILE_RECV) && !caximem_dev->recv_open) {
+        caximem_recv_close(caximem_dev);
+    }
+    caximem_pin_release(caximem_dev, ctx);
+    up(&caximem_dev->file_sem);
+    file->private_data = NULL;
+    caximem_ring_free(&ctx->recv_ring);
+    kfree(ctx);
+    caximem_debug("release device\n");
+    return 0;
+}
+
+/**
+ * @brief show the counters of a file in /proc/<pid>/fdinfo/<fd>
+ *
+ * @param m The seq file of fdinfo
+ * @param file The file opened on the caximem device
+ */
+static void caximem_show_fdinfo(struct seq_file *m, struct file *file) {
+    struct caximem_file *ctx;
+    ctx = (struct caximem_file *)file->private_data;
+    seq_printf(m, "caximem-shared:\t%d\n", ctx->shared);
+    seq_printf(m, "caximem-dirs:\t%s\n", ctx->dirs == CAXIMEM_FILE_DUPLEX ? "duplex" : ctx->dirs == CAXIMEM_FILE_SEND ? "tx" : "rx");
+    seq_printf(m, "caximem-send-frames:\t%lld\n", (long long)atomic64_read(&ctx->stats.send_frames));
+    seq_printf(m, "caximem-send-bytes:\t%lld\n", (long long)atomic64_read(&ctx->stats.send_bytes));
+    seq_printf(m, "caximem-recv-frames:\t%lld\n", (long long)atomic64_read(&ctx->stats.recv_frames));
+    seq_printf(m, "caximem-recv-bytes:\t%lld\n", (long long)atomic64_read(&ctx->stats.recv_bytes));
+    seq_printf(m, "caximem-recv-dropped:\t%lld\n", (long long)atomic64_read(&ctx->stats.recv_dropped));
+}
+
+/**
+ * @brief poll the character device
+ *
+ * In the blocking recv mode poll arms the recv window, so a frame can arrive
+ * before read is called.
+ *
+ * @param file The file structure pointer
+ * @param wait The poll table
+ * @return __poll_t Returns EPOLLIN if a frame can be read and EPOLLOUT if a frame can be written
+ */
+static __poll_t caximem_poll(struct file *file, poll_table *wait) {
+    struct caximem_file *ctx;
+    struct caximem_device *caximem_dev;
+    __poll_t mask = 0;
+    ctx = (struct caximem_file *)file->private_data;
+    caximem_dev = ctx->dev;
+    poll_wait(file, &caximem_dev->recv_wq_head, wait);
+    poll_wait(file, &caximem_dev->send_wq_head, wait);
+    if (!(ctx->dirs & CAXIMEM_FILE_RECV)) {
+        // Nothing to read from the tx node
+    } else if (ctx->shared) {
+        if (!caximem_ring_empty(&ctx->recv_ring)) {
+            mask |= EPOLLIN | EPOLLRDNORM;
+        }
+    } else if (caximem_dev->recv_ring_slots) {
+        if (!caximem_ring_empty(&caximem_dev->recv_ring)) {
+            mask |= EPOLLIN | EPOLLRDNORM;
+        }
+    } else if (!down_trylock(&caximem_dev->recv_sem)) {
+        caximem_recv_start(caximem_dev);
+        if (caximem_recv_ready(caximem_dev)) {
+            mask |= EPOLLIN | EPOLLRDNORM;
+        }
+        up(&caximem_dev->recv_sem);
+    }
+    if (!(ctx->dirs & CAXIMEM_FILE_SEND)) {
+        // Nothing to write to the rx node
+    } else if (ctx->shared) {
+        // A write through a shared file first reserves its slot, see caximem_file_send_lock
+        spin_lock(&caximem_dev->send_reserve_lock);
+        if (caximem_send_free(caximem_dev)) {
+            mask |= EPOLLOUT | EPOLLWRNORM;
+        }
+        spin_unlock(&caximem_dev->send_reserve_lock);
+    } else if (caximem_dev->send_queue_slots) {
+        if (!caximem_ring_full(&caximem_dev->send_queue)) {
+            mask |= EPOLLOUT | EPOLLWRNORM;
+        }
+    } else if (caximem_send_idle(caximem_dev)) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    return mask;
+}
+
+/**
+ * @brief wait until all queued frames have been sent when the device is closed
  *
- * @param file  The file structure pointer
- * @param buffer  The memory address of user space
- * @param length  The number of bytes to write
- * @param offset  The offset of the write position relative to the beginning of the file
- * @return ssize_t  Returns the number of bytes written, or error code less than 0 for errors
+ * A shared file only waits until its own frames have left the send queue.
+ *
+ * @param file The file structure pointer
+ * @param id The owner of the file table
+ * @return int Returns 0, or error code less than 0 if interrupted
  */
-static ssize_t caximem_write(struct file *file, const char __user *buffer, size_t length, loff_t *offset) {
-    unsigned long p;
+static int caximem_flush(struct file *file, fl_owner_t id) {
+    struct caximem_file *ctx;
     struct caximem_device *caximem_dev;
-    int rc;
-    int atomic_store;
-    p = *offset;
-    caximem_dev = (struct caximem_device *)file->private_data;
-    down(&caximem_dev->send_sem);
-    if (p > caximem_dev->send_max_size) {
-        caximem_err("Invalid offset.\n");
-        rc = length == 0 ? 0 : -ENXIO;
-        goto up_sem;
+    ctx = (struct caximem_file *)file->private_data;
+    caximem_dev = ctx->dev;
+    if (!caximem_dev->send_queue_slots || !(ctx->dirs & CAXIMEM_FILE_SEND)) {
+        return 0;
     }
-    if (length > caximem_dev->send_max_size - sizeof(caximem_ctrl_t)) {
-        length = caximem_dev->send_max_size - sizeof(caximem_ctrl_t);
+    if (caximem_dev->batch_frames) {
+        // Do not hold a partial batch back until batch_us
+        atomic_set(&caximem_dev->batch_flush, 1);
+        queue_work(system_highpri_wq, &caximem_dev->send_work);
     }
-    if (copy_from_user((char *)caximem_dev->send_buffer + sizeof(caximem_ctrl_t), buffer, length)) {
-        caximem_err("Write buffer failed.\n");
-        rc = -EFAULT;
-    } else {
-        atomic_store = atomic_read(&caximem_dev->send_wait);
-        atomic_inc(&caximem_dev->send_wait);
-        caximem_dev->send_info.size = length;
-        caximem_dev->send_info.enable = true;
-        caximem_ctrl_set(caximem_dev->send_info_reg, &caximem_dev->send_info);
-        wait_event(caximem_dev->send_wq_head, atomic_read(&caximem_dev->send_wait) == atomic_store);
-        caximem_debug("write %d bytes from %ld.\n", length, p);
-        rc = length;
+    if (ctx->shared) {
+        // The queue also holds the frames of the other files
+        return wait_event_interruptible(caximem_dev->send_wq_head, caximem_file_send_done(ctx));
     }
-up_sem:
-    up(&caximem_dev->send_sem);
-    return rc;
+    return wait_event_interruptible(caximem_dev->send_wq_head,
+                                    caximem_ring_empty(&caximem_dev->send_queue) &&
+                                        !atomic_read(&caximem_dev->send_busy));
 }
 
 /**
- * @brief open the character device
+ * @brief map the send or recv window into user space
+ *
+ * The window is selected by CAXIMEM_MMAP_SEND_OFFSET / CAXIMEM_MMAP_RECV_OFFSET,
+ * frames are then committed with CAXIMEM_SEND_COMMIT and CAXIMEM_RECV_COMMIT.
+ * CAXIMEM_MMAP_URING_OFFSET maps the rings of CAXIMEM_URING_SETUP instead.
  *
- * @param inode The inode structure pointer
  * @param file The file structure pointer
+ * @param vma The virtual memory area to map the window to
  * @return int Returns 0, or error code less than 0 for errors
  */
-static int caximem_open(struct inode *inode, struct file *file) {
+static int caximem_mmap(struct file *file, struct vm_area_struct *vma) {
+    struct caximem_file *ctx;
     struct caximem_device *caximem_dev;
-    caximem_dev = container_of(inode->i_cdev, struct caximem_device, chrdev);
-    if (caximem_dev->magic != CAXIMEM_MAGIC) {
-        caximem_err("caximem_dev 0x%p inode 0x%lx magic mismatch 0x%x.\n", caximem_dev, inode->i_ino, caximem_dev->magic);
-        return -EINVAL;
+    unsigned long offset, size;
+    unsigned long base, max_size;
+    unsigned int dirs;
+    ctx = (struct caximem_file *)file->private_data;
+    caximem_dev = ctx->dev;
+    offset = vma->vm_pgoff << PAGE_SHIFT;
+    size = vma->vm_end - vma->vm_start;
+    if (offset >= CAXIMEM_MMAP_URING_OFFSET) {
+        return caximem_uring_mmap(caximem_dev, vma);
     }
-    if (!capable(CAP_SYS_ADMIN)) {
-        caximem_err("No permission.\n");
+    if (offset >= CAXIMEM_MMAP_RECV_OFFSET) {
+        offset -= CAXIMEM_MMAP_RECV_OFFSET;
+        base = caximem_dev->recv_offset;
+        max_size = caximem_dev->recv_max_size;
+        dirs = CAXIMEM_FILE_RECV;
+    } else {
+        base = caximem_dev->send_offset;
+        max_size = caximem_dev->send_max_size;
+        dirs = CAXIMEM_FILE_SEND;
+    }
+    if (!(ctx->dirs & dirs)) {
+        caximem_err("The window is owned by the other node.\n");
         return -EACCES;
-    } else if (!(file->f_flags & O_EXCL)) {
-        caximem_err("No O_EXCL flags.\n");
+    }
+    if (offset_in_page(base) || offset > max_size || size > max_size - offset) {
+        caximem_err("Invalid mmap range 0x%lx + 0x%lx.\n", offset, size);
         return -EINVAL;
     }
-    if (down_trylock(&caximem_dev->file_sem)) {
-        caximem_err("Current device is busy.\n");
-        return -EBUSY;
+    vma->vm_flags |= VM_IO | VM_DONTEXPAND | VM_DONTDUMP;
+    if (caximem_dev->sim) {
+        // The simulated windows are ordinary memory
+    } else if (dirs == CAXIMEM_FILE_SEND && caximem_dev->send_wc) {
+        // The same write-combining mapping as the kernel copy, SEND_COMMIT orders the header behind the frame
+        vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+    } else {
+        vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
     }
-    atomic_set(&caximem_dev->send_wait, 0);
-    atomic_set(&caximem_dev->recv_wait, 0);
-    file->private_data = caximem_dev;
-    caximem_debug("open device\n");
-    return 0;
+    return io_remap_pfn_range(vma, vma->vm_start, (base + offset) >> PAGE_SHIFT, size, vma->vm_page_prot);
 }
 
 /**
- * @brief release the character device
+ * @brief send or receive a batch of frames with one semaphore acquisition
  *
- * @param inode The inode structure pointer
  * @param file The file structure pointer
- * @return int Returns 0, or error code less than 0 for errors
+ * @param cmd CAXIMEM_SEND_MMSG or CAXIMEM_RECV_MMSG
+ * @param arg The user address of struct caximem_mmsg_batch
+ * @return long Returns the number of frames transferred, or error code less than 0 if none was
  */
-static int caximem_release(struct inode *inode, struct file *file) {
+static long caximem_ioctl_mmsg(struct file *file, unsigned int cmd, unsigned long arg) {
+    struct caximem_file *ctx;
     struct caximem_device *caximem_dev;
-    caximem_dev = container_of(inode->i_cdev, struct caximem_device, chrdev);
-    if (caximem_dev->magic != CAXIMEM_MAGIC) {
-        caximem_err("caximem_dev 0x%p inode 0x%lx magic mismatch 0x%x.\n", caximem_dev, inode->i_ino, caximem_dev->magic);
+    struct caximem_mmsg_batch batch;
+    struct caximem_mmsg *msgs;
+    struct semaphore *sem;
+    unsigned int i;
+    bool send, per_msg, nonblock, dontwait;
+    struct iovec iov;
+    struct iov_iter iter;
+    size_t frame;
+    ssize_t rc;
+    ctx = (struct caximem_file *)file->private_data;
+    caximem_dev = ctx->dev;
+    if (copy_from_user(&batch, (void __user *)arg, sizeof(batch))) {
+        return -EFAULT;
+    }
+    if (batch.count == 0) {
+        return 0;
+    }
+    if (batch.count > CAXIMEM_MMSG_MAX) {
         return -EINVAL;
     }
-    atomic_set(&caximem_dev->send_wait, 0);
-    atomic_set(&caximem_dev->recv_wait, 0);
-    caximem_dev->send_info.size = 0;
-    caximem_dev->send_info.enable = false;
-    caximem_dev->recv_info.size = 0;
-    caximem_dev->recv_info.enable = false;
-    caximem_ctrl_set(caximem_dev->send_info_reg, &caximem_dev->send_info);
-    caximem_ctrl_set(caximem_dev->recv_info_reg, &caximem_dev->recv_info);
-    file->private_data = NULL;
-    up(&caximem_dev->file_sem);
-    caximem_debug("release device\n");
-    return 0;
+    msgs = memdup_user(u64_to_user_ptr(batch.msgs), batch.count * sizeof(*msgs));
+    if (IS_ERR(msgs)) {
+        return PTR_ERR(msgs);
+    }
+    send = cmd == CAXIMEM_SEND_MMSG;
+    sem = send ? &caximem_dev->send_sem : caximem_file_recv_sem(ctx);
+    nonblock = file->f_flags & O_NONBLOCK;
+    // A shared file reserves a queue slot for each frame, see caximem_file_send_lock
+    per_msg = send && ctx->shared;
+    if (per_msg) {
+        // send_sem is taken for each frame
+    } else if (nonblock) {
+        if (down_trylock(sem)) {
+            kfree(msgs);
+            return -EAGAIN;
+        }
+    } else {
+        down(sem);
+    }
+    rc = 0;
+    for (i = 0; i < batch.count; i++) {
+        dontwait = nonblock || (msgs[i].flags & CAXIMEM_MSG_DONTWAIT) ||
+                   (i > 0 && (batch.flags & CAXIMEM_MMSG_WAITFORONE));
+        msgs[i].flags &= ~CAXIMEM_MSG_TRUNC;
+        rc = import_single_range(send ? WRITE : READ, u64_to_user_ptr(msgs[i].ptr), msgs[i].len, &iov, &iter);
+        if (rc == 0 && per_msg) {
+            rc = caximem_file_send_lock(ctx, dontwait);
+            if (rc == 0) {
+                rc = caximem_file_write(ctx, &iter, dontwait);
+                caximem_file_send_unlock(ctx);
+            }
+            frame = msgs[i].len;
+        } else if (rc == 0 && send) {
+            rc = caximem_file_write(ctx, &iter, dontwait);
+            frame = msgs[i].len;
+        } else if (rc == 0) {
+            rc = caximem_file_read(ctx, &iter, dontwait, &frame);
+        }
+        msgs[i].status = rc < 0 ? rc : 0;
+        if (rc < 0) {
+            break;
+        }
+        if (frame > (size_t)rc) {
+            msgs[i].flags |= CAXIMEM_MSG_TRUNC;
+        }
+        msgs[i].len = rc;
+    }
+    if (!per_msg) {
+        up(sem);
+    }
+    // Report the frames done and the status of the one that failed
+    if (copy_to_user(u64_to_user_ptr(batch.msgs), msgs, min(i + 1, batch.count) * sizeof(*msgs))) {
+        rc = -EFAULT;
+    } else if (i > 0) {
+        rc = i;
+    }
+    kfree(msgs);
+    return rc;
 }
 
 /**
- * @brief mmap (not supported)
+ * @brief send a request and wait for the response within one call
  *
- * @return int Return -EPREM directly.
+ * The recv window is armed before the request goes out, so a response
+ * arriving right after the doorbell is not missed. O_NONBLOCK only applies
+ * to sending the request, the response is always waited for.
+ *
+ * @param file The file structure pointer
+ * @param arg The user address of struct caximem_transact
+ * @return long Returns 0, or error code less than 0 for errors
  */
-static int caximem_mmap(struct file *file, struct vm_area_struct *vma) {
-    return -EPERM;
+static long caximem_ioctl_transact(struct file *file, unsigned long arg) {
+    struct caximem_file *ctx;
+    struct caximem_device *caximem_dev;
+    struct caximem_transact xact;
+    struct iovec iov;
+    struct iov_iter iter;
+    struct semaphore *recv_sem;
+    size_t frame;
+    bool nonblock;
+    ssize_t rc;
+    ctx = (struct caximem_file *)file->private_data;
+    caximem_dev = ctx->dev;
+    if (ctx->dirs != CAXIMEM_FILE_DUPLEX) {
+        // The response would have to be read from the other node
+        return -EBADF;
+    }
+    if (copy_from_user(&xact, (void __user *)arg, sizeof(xact))) {
+        return -EFAULT;
+    }
+    recv_sem = caximem_file_recv_sem(ctx);
+    nonblock = file->f_flags & O_NONBLOCK;
+    rc = caximem_file_send_lock(ctx, nonblock);
+    if (rc < 0) {
+        return rc;
+    }
+    if (nonblock) {
+        if (down_trylock(recv_sem)) {
+            caximem_file_send_unlock(ctx);
+            return -EAGAIN;
+        }
+    } else {
+        down(recv_sem);
+    }
+    if (!caximem_dev->recv_ring_slots && !caximem_dev->uring.active) {
+        caximem_recv_start(caximem_dev);
+    }
+    rc = import_single_range(WRITE, u64_to_user_ptr(xact.req), xact.req_len, &iov, &iter);
+    if (rc == 0) {
+        rc = caximem_file_write(ctx, &iter, nonblock);
+    }
+    if (rc >= 0) {
+        rc = import_single_range(READ, u64_to_user_ptr(xact.resp), xact.resp_len, &iov, &iter);
+    }
+    if (rc >= 0) {
+        rc = caximem_file_read(ctx, &iter, false, &frame);
+    }
+    up(recv_sem);
+    caximem_file_send_unlock(ctx);
+    if (rc < 0) {
+        return rc;
+    }
+    xact.resp_len = rc;
+    xact.flags = frame > (size_t)rc ? CAXIMEM_MSG_TRUNC : 0;
+    if (copy_to_user((void __user *)arg, &xact, sizeof(xact))) {
+        return -EFAULT;
+    }
+    return 0;
 }
 
 /**
@@ -223,25 +1984,185 @@ static int caximem_mmap(struct file *file, struct vm_area_struct *vma) {
  * @return long Returns 0, or error code less than 0 for errors
  */
 static long caximem_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    struct caximem_file *ctx;
     struct caximem_device *caximem_dev;
+    struct caximem_info info;
+    struct caximem_buf buf;
+    struct caximem_eventfd efd;
+    struct caximem_uring_params params;
+    struct caximem_uring_enter enter;
+    __u32 length;
+    size_t size;
     long rc;
     rc = 0;
-    caximem_dev = (struct caximem_device *)file->private_data;
+    ctx = (struct caximem_file *)file->private_data;
+    caximem_dev = ctx->dev;
 
     switch (cmd) {
+    case CAXIMEM_GET_INFO:
+        info.send_size = caximem_dev->send_max_size;
+        info.recv_size = caximem_dev->recv_max_size;
+        info.data_offset = sizeof(caximem_ctrl_t);
+        info.send_max_frame = caximem_dev->send_slot_size - sizeof(caximem_ctrl_t);
+        if (caximem_dev->batch_frames) {
+            info.send_max_frame -= sizeof(struct caximem_batch_rec);
+        }
+        info.recv_max_frame = caximem_dev->recv_max_size - sizeof(caximem_ctrl_t);
+        if (copy_to_user((void __user *)arg, &info, sizeof(info)))
+            rc = -EFAULT;
+        break;
+    case CAXIMEM_SEND_COMMIT:
+        if (!(ctx->dirs & CAXIMEM_FILE_SEND)) {
+            rc = -EBADF;
+            break;
+        }
+        if (caximem_dev->send_queue_slots || caximem_dev->send_slots > 1 || caximem_dev->uring.active) {
+            // The send window belongs to the queue or uring worker, or is split into slots
+            rc = -EBUSY;
+            break;
+        }
+        if (get_user(length, (__u32 __user *)arg)) {
+            rc = -EFAULT;
+            break;
+        }
+        trace_caximem_write_start(caximem_dev->dev_id, length);
+        if (length > caximem_dev->send_max_size - sizeof(caximem_ctrl_t)) {
+            caximem_err("Invalid commit length %u.\n", length);
+            rc = -EINVAL;
+            break;
+        }
+        down(&caximem_dev->send_sem);
+        rc = caximem_send_wait_idle(caximem_dev, file->f_flags & O_NONBLOCK);
+        if (rc == 0) {
+            caximem_send_locked(caximem_dev, length, file->f_flags & O_NONBLOCK);
+        }
+        up(&caximem_dev->send_sem);
+        break;
+    case CAXIMEM_RECV_COMMIT:
+        if (!(ctx->dirs & CAXIMEM_FILE_RECV)) {
+            rc = -EBADF;
+            break;
+        }
+        if (caximem_dev->recv_ring_slots || caximem_dev->uring.active) {
+            // The recv window belongs to the ring or uring worker
+            rc = -EBUSY;
+            break;
+        }
+        down(&caximem_dev->recv_sem);
+        rc = caximem_recv_locked(caximem_dev, file->f_flags & O_NONBLOCK, &size);
+        if (rc == 0) {
+            caximem_recv_disarm(caximem_dev);
+        }
+        up(&caximem_dev->recv_sem);
+        if (rc == 0 && put_user((__u32)size, (__u32 __user *)arg))
+            rc = -EFAULT;
+        break;
     case CAXIMEM_CANCEL:
-        while (waitqueue_active(&caximem_dev->recv_wq_head)) {
-            atomic_dec(&caximem_dev->recv_wait);
+        atomic64_inc(&caximem_dev->stats.cancels);
+        trace_caximem_cancel(caximem_dev->dev_id);
+        if (ctx->shared) {
+            // Only the readers of this file, the send queue holds frames of the other files
+            atomic_inc(&ctx->recv_cancel);
+            wake_up(&caximem_dev->recv_wq_head);
+            break;
+        }
+        if (!(ctx->dirs & CAXIMEM_FILE_RECV)) {
+            // The readers belong to the rx node
+        } else if (caximem_dev->recv_ring_slots) {
+            atomic_inc(&caximem_dev->recv_cancel);
+            wake_up(&caximem_dev->recv_wq_head);
+        } else {
+            // An armed window reads as an empty frame
+            atomic_set(&caximem_dev->recv_wait, 0);
             wake_up(&caximem_dev->recv_wq_head);
         }
-        while (waitqueue_active(&caximem_dev->send_wq_head)) {
-            caximem_dev->send_info.size = 0;
-            caximem_dev->send_info.enable = false;
-            caximem_ctrl_set(caximem_dev->send_info_reg, &caximem_dev->send_info);
-            atomic_dec(&caximem_dev->send_wait);
+        if (!(ctx->dirs & CAXIMEM_FILE_SEND)) {
+            // The writers belong to the tx node
+        } else if (caximem_dev->send_queue_slots) {
+            // Drop queued frames in the worker, it is the only consumer of the queue and the slots
+            atomic_set(&caximem_dev->send_discard, 1);
+            queue_work(system_highpri_wq, &caximem_dev->send_work);
+        } else {
+            // Disabled slots are not sent, fill the first one next
+            caximem_send_reset(caximem_dev);
+            atomic_set(&caximem_dev->send_wait, 0);
             wake_up(&caximem_dev->send_wq_head);
         }
-        caximem_debug("get caximem cancel request\n");
+        break;
+    case CAXIMEM_SEND_MMSG:
+    case CAXIMEM_RECV_MMSG:
+        rc = caximem_ioctl_mmsg(file, cmd, arg);
+        break;
+    case CAXIMEM_REGISTER_BUF:
+    case CAXIMEM_UNREGISTER_BUF:
+        if (ctx->shared) {
+            // Shared files keep to the bounce buffer
+            rc = -EBUSY;
+            break;
+        }
+        if (copy_from_user(&buf, (void __user *)arg, sizeof(buf))) {
+            rc = -EFAULT;
+            break;
+        }
+        if (cmd == CAXIMEM_REGISTER_BUF) {
+            rc = caximem_pin_register(caximem_dev, ctx, (unsigned long)buf.addr, (size_t)buf.len);
+        } else {
+            rc = caximem_pin_unregister(caximem_dev, ctx, (unsigned long)buf.addr);
+        }
+        break;
+    case CAXIMEM_SET_EVENTFD:
+        if (ctx->shared) {
+            // The eventfds belong to the device, not to one of the files
+            rc = -EBUSY;
+            break;
+        }
+        if (copy_from_user(&efd, (void __user *)arg, sizeof(efd))) {
+            rc = -EFAULT;
+            break;
+        }
+        // A node owning one direction only sets the eventfd of that direction
+        if (ctx->dirs & CAXIMEM_FILE_SEND) {
+            rc = caximem_set_eventfd(caximem_dev, &caximem_dev->send_eventfd, efd.send_fd);
+        }
+        if (rc == 0 && (ctx->dirs & CAXIMEM_FILE_RECV)) {
+            rc = caximem_set_eventfd(caximem_dev, &caximem_dev->recv_eventfd, efd.recv_fd);
+        }
+        break;
+    case CAXIMEM_URING_SETUP:
+        if (ctx->shared || ctx->dirs != CAXIMEM_FILE_DUPLEX) {
+            // The rings would take the windows from the other files
+            rc = -EBUSY;
+            break;
+        }
+        if (copy_from_user(&params, (void __user *)arg, sizeof(params))) {
+            rc = -EFAULT;
+            break;
+        }
+        // Wait for running reads and writes, the rings own the windows afterwards
+        down(&caximem_dev->send_sem);
+        down(&caximem_dev->recv_sem);
+        rc = caximem_uring_setup(caximem_dev, &params);
+        up(&caximem_dev->recv_sem);
+        up(&caximem_dev->send_sem);
+        if (rc == 0 && copy_to_user((void __user *)arg, &params, sizeof(params))) {
+            // The rings stay set up, ENTER or mmap may already use them, close frees them
+            rc = -EFAULT;
+        }
+        break;
+    case CAXIMEM_TRANSACT:
+        if (ctx->shared) {
+            // The response is fanned out to every shared file, not only to the issuing one
+            rc = -EBUSY;
+            break;
+        }
+        rc = caximem_ioctl_transact(file, arg);
+        break;
+    case CAXIMEM_URING_ENTER:
+        if (copy_from_user(&enter, (void __user *)arg, sizeof(enter))) {
+            rc = -EFAULT;
+            break;
+        }
+        rc = caximem_uring_enter(caximem_dev, &enter);
         break;
     default:
         rc = -EPERM;
@@ -250,14 +2171,113 @@ static long caximem_ioctl(struct file *file, unsigned int cmd, unsigned long arg
     return rc;
 }
 
+// Clear the send and recv headers of the mapped windows
+static void caximem_hw_reset(struct caximem_device *dev) {
+    dev->recv_info_reg = (caximem_ctrl_t *)dev->recv_buffer;
+    dev->recv_info.size = 0;
+    dev->recv_info.enable = false;
+    caximem_send_reset(dev);
+    caximem_ctrl_set(dev->recv_info_reg, &dev->recv_info);
+}
+
+/**
+ * @brief map the windows of the PL and request its interrupts
+ *
+ * @param dev The caximem device
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+static int caximem_hw_init(struct caximem_device *dev) {
+    int rc;
+
+    if (dev->sim) {
+        caximem_sim_attach(dev, send_irq_handler, recv_irq_handler);
+        caximem_hw_reset(dev);
+        return 0;
+    }
+
+    // Init send buffer
+    if (dev->send_wc) {
+        dev->send_buffer = ioremap_wc(dev->send_offset, dev->send_max_size);
+    } else {
+        dev->send_buffer = ioremap(dev->send_offset, dev->send_max_size);
+    }
+    if (dev->send_buffer == NULL) {
+        caximem_err("send buffer ioremap error");
+        return -ENOMEM;
+    }
+    dev->recv_buffer = ioremap(dev->recv_offset, dev->recv_max_size);
+    if (dev->recv_buffer == NULL) {
+        caximem_err("recv buffer ioremap error");
+        rc = -ENOMEM;
+        goto unmap_send_buffer;
+    }
+    // The handlers look at the headers as soon as the interrupts are requested
+    caximem_hw_reset(dev);
+
+    // Register interrupt
+    if (dev->irq_thread) {
+        rc = request_threaded_irq(dev->send_signal, send_irq_hard, send_irq_thread, IRQF_TRIGGER_RISING, MODULE_NAME,
+                                  dev);
+    } else {
+        rc = request_irq(dev->send_signal, send_irq_handler, IRQF_TRIGGER_RISING, MODULE_NAME, dev);
+    }
+    if (rc < 0) {
+        caximem_err("failed to request send interrupt.\n");
+        goto unmap_recv_buffer;
+    }
+    if (dev->irq_thread) {
+        rc = request_threaded_irq(dev->recv_signal, recv_irq_hard, recv_irq_thread, IRQF_TRIGGER_RISING, MODULE_NAME,
+                                  dev);
+    } else {
+        rc = request_irq(dev->recv_signal, recv_irq_handler, IRQF_TRIGGER_RISING, MODULE_NAME, dev);
+    }
+    if (rc < 0) {
+        caximem_err("failed to request send interrupt.\n");
+        goto send_irq_cleanup;
+    }
+    rc = caximem_irq_affinity(dev);
+    if (rc < 0) {
+        caximem_err("failed to set the affinity of the interrupts to cpu %d.\n", dev->irq_cpu);
+        goto recv_irq_cleanup;
+    }
+    return 0;
+
+recv_irq_cleanup:
+    irq_set_affinity_hint(dev->recv_signal, NULL);
+    irq_set_affinity_hint(dev->send_signal, NULL);
+    free_irq(dev->recv_signal, dev);
+send_irq_cleanup:
+    free_irq(dev->send_signal, dev);
+unmap_recv_buffer:
+    iounmap(dev->recv_buffer);
+unmap_send_buffer:
+    iounmap(dev->send_buffer);
+    return rc;
+}
+static void caximem_hw_exit(struct caximem_device *dev) {
+    if (dev->sim) {
+        caximem_sim_detach(dev);
+        return;
+    }
+    iounmap(dev->recv_buffer);
+    iounmap(dev->send_buffer);
+    irq_set_affinity_hint(dev->recv_signal, NULL);
+    irq_set_affinity_hint(dev->send_signal, NULL);
+    free_irq(dev->recv_signal, dev);
+    free_irq(dev->send_signal, dev);
+}
+
 static const struct file_operations caximem_fops = {
     .owner = THIS_MODULE,
     .open = caximem_open,
-    .read = caximem_read,
-    .write = caximem_write,
+    .read_iter = caximem_read_iter,
+    .write_iter = caximem_write_iter,
+    .poll = caximem_poll,
+    .flush = caximem_flush,
     .mmap = caximem_mmap,
     .unlocked_ioctl = caximem_ioctl,
-    .release = caximem_release};
+    .release = caximem_release,
+    .show_fdinfo = caximem_show_fdinfo};
 
 // Initialize caximem character device
 int caximem_chrdev_init(struct caximem_device *dev) {
@@ -266,11 +2286,66 @@ int caximem_chrdev_init(struct caximem_device *dev) {
     // Set macic number;
     dev->magic = CAXIMEM_MAGIC;
 
+    // Init semaphore, before the device can be opened
+    sema_init(&dev->file_sem, 1);
+    init_rwsem(&dev->files_sem);
+    INIT_LIST_HEAD(&dev->files);
+    sema_init(&dev->send_sem, 1);
+    sema_init(&dev->recv_sem, 1);
+    init_rwsem(&dev->pin_sem);
+    spin_lock_init(&dev->event_lock);
+    spin_lock_init(&dev->send_reserve_lock);
+    caximem_uring_init(dev);
+
+    // Init wait queue
+    init_waitqueue_head(&dev->send_wq_head);
+    init_waitqueue_head(&dev->recv_wq_head);
+
+    // Init doorbell times, several send slots can be in flight
+    dev->send_doorbell_ns = kcalloc(dev->send_slots, sizeof(*dev->send_doorbell_ns), GFP_KERNEL);
+    if (dev->send_doorbell_ns == NULL) {
+        rc = -ENOMEM;
+        goto ret;
+    }
+
+    // Init send queue
+    if (dev->send_queue_slots) {
+        rc = caximem_ring_init(&dev->send_queue, dev->send_queue_slots, dev->send_slot_size - sizeof(caximem_ctrl_t));
+        if (rc < 0) {
+            caximem_err("failed to allocate send queue.\n");
+            goto free_doorbell;
+        }
+        INIT_WORK(&dev->send_work, caximem_send_work);
+        if (dev->batch_frames) {
+            hrtimer_init(&dev->batch_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+            dev->batch_timer.function = caximem_batch_timer;
+        }
+    }
+
+    // Init recv ring
+    if (dev->recv_ring_slots) {
+        rc = caximem_ring_init(&dev->recv_ring, dev->recv_ring_slots, dev->recv_max_size - sizeof(caximem_ctrl_t));
+        if (rc < 0) {
+            caximem_err("failed to allocate recv ring.\n");
+            goto free_send_queue;
+        }
+        INIT_WORK(&dev->recv_work, caximem_recv_work);
+    }
+
+    // Init dma, frames are copied by the cpu if there is no channel
+    caximem_dma_init(dev);
+
+    // Map the windows and register interrupt, or use the software loopback backend
+    rc = caximem_hw_init(dev);
+    if (rc < 0) {
+        goto dma_cleanup;
+    }
+
     // Allocate a major and minor number region
-    rc = alloc_chrdev_region(&dev->cdevno, 0, 1, dev->dev_name);
+    rc = alloc_chrdev_region(&dev->cdevno, 0, dev->split_nodes ? CAXIMEM_NODES : 1, dev->dev_name);
     if (rc < 0) {
         caximem_err("failed to allocate character device region.\n");
-        goto ret;
+        goto hw_cleanup;
     }
 
     // Create device class
@@ -282,92 +2357,88 @@ int caximem_chrdev_init(struct caximem_device *dev) {
     }
 
     // Create device
-    dev->sys_device = device_create(dev->dev_class, NULL, dev->cdevno, NULL, dev_fmt, dev->dev_name, dev->dev_id);
+    dev->sys_device = device_create_with_groups(dev->dev_class, NULL, dev->cdevno, dev, caximem_groups, dev_fmt, dev->dev_name, dev->dev_id);
     if (IS_ERR(dev->sys_device)) {
         caximem_err("failed to create device.\n");
         rc = PTR_ERR(dev->sys_device);
         goto class_cleanup;
     }
 
-    // Register this character device in kernel
-    cdev_init(&dev->chrdev, &caximem_fops);
-    rc = cdev_add(&dev->chrdev, dev->cdevno, 1);
-    if (rc < 0) {
-        caximem_err("failed to add a character device.\n");
-        goto device_cleanup;
+    // Create the nodes owning one direction each, the minors follow caximem_node_dirs
+    if (dev->split_nodes) {
+        dev->tx_device = device_create(dev->dev_class, NULL, dev->cdevno + 1, dev, tx_fmt, dev->dev_name, dev->dev_id);
+        if (IS_ERR(dev->tx_device)) {
+            caximem_err("failed to create tx device.\n");
+            rc = PTR_ERR(dev->tx_device);
+            goto device_cleanup;
+        }
+        dev->rx_device = device_create(dev->dev_class, NULL, dev->cdevno + 2, dev, rx_fmt, dev->dev_name, dev->dev_id);
+        if (IS_ERR(dev->rx_device)) {
+            caximem_err("failed to create rx device.\n");
+            rc = PTR_ERR(dev->rx_device);
+            goto tx_cleanup;
+        }
     }
 
-    // Register interrupt
-    rc = request_irq(dev->send_signal, send_irq_handler, IRQF_TRIGGER_RISING, MODULE_NAME, dev);
-    if (rc < 0) {
-        caximem_err("failed to request send interrupt.\n");
-        goto chrdev_cleanup;
-    }
-    rc = request_irq(dev->recv_signal, recv_irq_handler, IRQF_TRIGGER_RISING, MODULE_NAME, dev);
-    if (rc < 0) {
-        caximem_err("failed to request send interrupt.\n");
-        goto send_irq_cleanup;
-    }
+    // Init statistics, the histograms are in debugfs
+    caximem_debugfs_init(dev);
 
-    // Init send buffer
-    dev->send_buffer = ioremap(dev->send_offset, dev->send_max_size);
-    if (dev->send_buffer == NULL) {
-        caximem_err("send buffer ioremap error");
-        rc = -ENOMEM;
-        goto send_irq_cleanup;
-    }
-    dev->send_info_reg = (caximem_ctrl_t *)dev->send_buffer;
-    dev->recv_buffer = ioremap(dev->recv_offset, dev->recv_max_size);
-    if (dev->recv_buffer == NULL) {
-        caximem_err("recv buffer ioremap error");
-        rc = -ENOMEM;
-        goto unmap_send_buffer;
+    // Register this character device in kernel last, it can be opened right away
+    cdev_init(&dev->chrdev, &caximem_fops);
+    rc = cdev_add(&dev->chrdev, dev->cdevno, dev->split_nodes ? CAXIMEM_NODES : 1);
+    if (rc < 0) {
+        caximem_err("failed to add a character device.\n");
+        goto debugfs_cleanup;
     }
-    dev->recv_info_reg = (caximem_ctrl_t *)dev->recv_buffer;
-    dev->send_info.size = 0;
-    dev->send_info.enable = false;
-    dev->recv_info.size = 0;
-    dev->recv_info.enable = false;
-    caximem_ctrl_set(dev->send_info_reg, &dev->send_info);
-    caximem_ctrl_set(dev->recv_info_reg, &dev->recv_info);
-
-    // Init semaphore
-    sema_init(&dev->file_sem, 1);
-    sema_init(&dev->send_sem, 1);
-    sema_init(&dev->recv_sem, 1);
-
-    // Init wait queue
-    init_waitqueue_head(&dev->send_wq_head);
-    init_waitqueue_head(&dev->recv_wq_head);
 
     // Success
     caximem_info("Success initialize chardev %s_%d.\n", dev->dev_name, dev->dev_id);
     return 0;
 
-unmap_send_buffer:
-    iounmap(dev->send_buffer);
-send_irq_cleanup:
-    free_irq(dev->send_signal, dev);
-chrdev_cleanup:
-    cdev_del(&dev->chrdev);
+debugfs_cleanup:
+    caximem_debugfs_exit(dev);
+    if (dev->split_nodes) {
+        device_destroy(dev->dev_class, dev->cdevno + 2);
+    }
+tx_cleanup:
+    if (dev->split_nodes) {
+        device_destroy(dev->dev_class, dev->cdevno + 1);
+    }
 device_cleanup:
     device_destroy(dev->dev_class, dev->cdevno);
 class_cleanup:
     class_destroy(dev->dev_class);
 free_chrdev_region:
-    unregister_chrdev_region(0, 1);
+    unregister_chrdev_region(dev->cdevno, dev->split_nodes ? CAXIMEM_NODES : 1);
+hw_cleanup:
+    caximem_hw_exit(dev);
+dma_cleanup:
+    caximem_dma_exit(dev);
+    caximem_ring_free(&dev->recv_ring);
+free_send_queue:
+    caximem_ring_free(&dev->send_queue);
+free_doorbell:
+    kfree(dev->send_doorbell_ns);
 ret:
     return rc;
 }
 
 // Clean up caximem character device struct
 void caximem_chrdev_exit(struct caximem_device *dev) {
-    iounmap(dev->recv_buffer);
-    iounmap(dev->send_buffer);
-    free_irq(dev->recv_signal, dev);
-    free_irq(dev->send_signal, dev);
+    // The reverse order of caximem_chrdev_init, the device cannot be opened after cdev_del
     cdev_del(&dev->chrdev);
+    caximem_debugfs_exit(dev);
+    if (dev->split_nodes) {
+        device_destroy(dev->dev_class, dev->cdevno + 2);
+        device_destroy(dev->dev_class, dev->cdevno + 1);
+    }
     device_destroy(dev->dev_class, dev->cdevno);
     class_destroy(dev->dev_class);
-    unregister_chrdev_region(0, 1);
+    unregister_chrdev_region(dev->cdevno, dev->split_nodes ? CAXIMEM_NODES : 1);
+    // Free interrupt before everything the handlers use
+    caximem_hw_exit(dev);
+    caximem_dma_exit(dev);
+    caximem_ring_free(&dev->recv_ring);
+    caximem_ring_free(&dev->send_queue);
+    kfree(dev->send_doorbell_ns);
 }
\ No newline at end of file
@@ -0,0 +1,631 @@
+/**
+ * @file caximem_copy.c
+ * @author wlanxww (xueweiwujxw@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-10-20
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/platform_device.h>
+#include <linux/dmaengine.h>
+#include <linux/dma-mapping.h>
+#include <linux/completion.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/io.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/sched/mm.h>
+#include <linux/scatterlist.h>
+#include <asm/unaligned.h>
+
+#include "caximem.h"
+#include "caximem_trace.h"
+
+/**
+ * Copies between frame data and the BRAM windows
+ *
+ * Small frames are copied by the CPU straight into the ioremapped window.
+ * Frames of at least dma_threshold bytes are staged in a DRAM bounce buffer
+ * and moved by a dmaengine memcpy channel, which does burst transfers while
+ * the CPU sleeps. Each direction has its own channel and bounce buffer, as
+ * send and recv are serialized independently.
+ *
+ * Frames of at least pin_threshold bytes coming from or going to user memory
+ * skip the bounce buffer: the user pages are pinned and mapped as a
+ * scatterlist, and the dma moves them directly to or from the window. Buffers
+ * registered with CAXIMEM_REGISTER_BUF stay pinned, so only the mapping is
+ * done per frame. If pinning fails, the rest of the frame is bounced.
+ *
+ * A send window mapped write-combining (write-combine in the device tree) is
+ * filled by the CPU in aligned bursts: the frame is staged in a small chunk on
+ * the stack and stored with 64 bit writes, or the ldm / stm of memcpy_toio on
+ * 32 bit ARM, which the write buffer merges into AXI bursts. The doorbell is
+ * ordered after the frame by caximem_send_doorbell().
+ */
+
+#define CAXIMEM_DMA_TIMEOUT_MS 1000
+#define CAXIMEM_BURST_CHUNK 256
+
+static void caximem_dma_callback(void *param) {
+    complete((struct completion *)param);
+}
+
+/**
+ * @brief request the dma channel and bounce buffer of one direction
+ *
+ * @param dev The caximem device
+ * @param path The dma path to initialize
+ * @param name The dma-names entry in the device tree
+ * @param offset The physical address of the window
+ * @param size The size of the window
+ * @return int Returns 0, or error code less than 0 if the direction falls back to the CPU
+ */
+static int caximem_dma_path_init(struct caximem_device *dev, struct caximem_dma_path *path, const char *name,
+                                 unsigned long offset, unsigned long size) {
+    dma_cap_mask_t mask;
+    struct device *dma_dev;
+
+    init_completion(&path->done);
+    path->chan = dma_request_chan(&dev->pdev->dev, name);
+    if (IS_ERR(path->chan)) {
+        // No channel in the device tree, take any memcpy channel (e.g. the PS PL330)
+        dma_cap_zero(mask);
+        dma_cap_set(DMA_MEMCPY, mask);
+        path->chan = dma_request_chan_by_mask(&mask);
+        if (IS_ERR(path->chan)) {
+            path->chan = NULL;
+            return -ENODEV;
+        }
+    }
+    dma_dev = path->chan->device->dev;
+
+    path->bounce = kmalloc(size, GFP_KERNEL);
+    if (path->bounce == NULL) {
+        goto release_chan;
+    }
+    path->window = dma_map_resource(dma_dev, offset, size, DMA_BIDIRECTIONAL, 0);
+    if (dma_mapping_error(dma_dev, path->window)) {
+        goto free_bounce;
+    }
+    return 0;
+
+free_bounce:
+    kfree(path->bounce);
+    path->bounce = NULL;
+release_chan:
+    dma_release_channel(path->chan);
+    path->chan = NULL;
+    return -ENOMEM;
+}
+
+static void caximem_dma_path_exit(struct caximem_dma_path *path, unsigned long size) {
+    if (path->chan == NULL) {
+        return;
+    }
+    dma_unmap_resource(path->chan->device->dev, path->window, size, DMA_BIDIRECTIONAL, 0);
+    kfree(path->bounce);
+    dma_release_channel(path->chan);
+    path->bounce = NULL;
+    path->chan = NULL;
+}
+
+/**
+ * @brief run one dma memcpy and wait for it
+ *
+ * @param path The dma path to use
+ * @param dst The dma address of the destination
+ * @param src The dma address of the source
+ * @param length The number of bytes to copy
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+static int caximem_dma_memcpy(struct caximem_dma_path *path, dma_addr_t dst, dma_addr_t src, size_t length) {
+    struct dma_async_tx_descriptor *tx;
+    dma_cookie_t cookie;
+
+    tx = dmaengine_prep_dma_memcpy(path->chan, dst, src, length, DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+    if (tx == NULL) {
+        return -EIO;
+    }
+    reinit_completion(&path->done);
+    tx->callback = caximem_dma_callback;
+    tx->callback_param = &path->done;
+    cookie = dmaengine_submit(tx);
+    if (dma_submit_error(cookie)) {
+        return -EIO;
+    }
+    dma_async_issue_pending(path->chan);
+    if (!wait_for_completion_timeout(&path->done, msecs_to_jiffies(CAXIMEM_DMA_TIMEOUT_MS))) {
+        dmaengine_terminate_sync(path->chan);
+        return -ETIMEDOUT;
+    }
+    return 0;
+}
+
+static bool caximem_dma_use(struct caximem_device *dev, struct caximem_dma_path *path, size_t length) {
+    unsigned int threshold = READ_ONCE(dev->dma_threshold);
+    return path->chan != NULL && threshold != 0 && length >= threshold;
+}
+
+static bool caximem_pin_use(struct caximem_device *dev, struct caximem_dma_path *path, struct iov_iter *iter,
+                            size_t length) {
+    unsigned int threshold = READ_ONCE(dev->pin_threshold);
+    return path->chan != NULL && threshold != 0 && length >= threshold && iter_is_iovec(iter);
+}
+
+/**
+ * @brief find the pages of a registered buffer covering a user range
+ *
+ * Only the buffers registered from the address space of the caller match, the
+ * tx and rx nodes may be opened by two processes using the same addresses.
+ *
+ * @param dev The caximem device, pin_sem must be held
+ * @param start The user address of the range
+ * @param len The length of the range
+ * @return struct page** Returns the page holding start, or NULL if no buffer covers the range
+ */
+static struct page **caximem_pin_lookup(struct caximem_device *dev, unsigned long start, size_t len) {
+    struct caximem_pinned *buf;
+    unsigned int i;
+    for (i = 0; i < CAXIMEM_PINNED_MAX; i++) {
+        buf = &dev->pinned[i];
+        if (buf->addr != 0 && buf->mm == current->mm && start >= buf->addr && start + len <= buf->addr + buf->len) {
+            return buf->pages + (((start & PAGE_MASK) - (buf->addr & PAGE_MASK)) >> PAGE_SHIFT);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief move frame data between user pages and a window with the dma, without the bounce buffer
+ *
+ * @param dev The caximem device
+ * @param path The dma path to use
+ * @param iter The user iterator, advanced by the bytes moved
+ * @param window The dma address in the window
+ * @param length The number of bytes to move
+ * @param send true to move into the send window, false to move out of the recv window
+ * @param dma_ns Returns the time spent waiting for the dma
+ * @return size_t Returns the number of bytes moved, the caller copies the rest
+ */
+static size_t caximem_dma_user(struct caximem_device *dev, struct caximem_dma_path *path, struct iov_iter *iter,
+                               dma_addr_t window, size_t length, bool send, u64 *dma_ns) {
+    enum dma_data_direction dir = send ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+    struct device *dma_dev = path->chan->device->dev;
+    struct iovec iov;
+    struct page **pages;
+    struct sg_table sgt;
+    struct scatterlist *sg;
+    unsigned long start;
+    size_t done, seg, off;
+    int npages, pinned, i, rc;
+    bool registered;
+    u64 begin;
+
+    done = 0;
+    *dma_ns = 0;
+    down_read(&dev->pin_sem);
+    while (done < length) {
+        iov = iov_iter_iovec(iter);
+        seg = min(iov.iov_len, length - done);
+        start = (unsigned long)iov.iov_base;
+        npages = DIV_ROUND_UP(offset_in_page(start) + seg, PAGE_SIZE);
+        pages = caximem_pin_lookup(dev, start, seg);
+        registered = pages != NULL;
+        if (!registered) {
+            pages = kmalloc_array(npages, sizeof(*pages), GFP_KERNEL);
+            if (pages == NULL) {
+                break;
+            }
+            pinned = pin_user_pages_fast(start & PAGE_MASK, npages, send ? 0 : FOLL_WRITE, pages);
+            if (pinned != npages) {
+                if (pinned > 0) {
+                    unpin_user_pages(pages, pinned);
+                }
+                kfree(pages);
+                break;
+            }
+        }
+        rc = sg_alloc_table_from_pages(&sgt, pages, npages, offset_in_page(start), seg, GFP_KERNEL);
+        if (rc == 0) {
+            rc = dma_map_sgtable(dma_dev, &sgt, dir, 0);
+            if (rc == 0) {
+                off = done;
+                begin = ktime_get_ns();
+                for_each_sgtable_dma_sg(&sgt, sg, i) {
+                    if (send) {
+                        rc = caximem_dma_memcpy(path, window + off, sg_dma_address(sg), sg_dma_len(sg));
+                    } else {
+                        rc = caximem_dma_memcpy(path, sg_dma_address(sg), window + off, sg_dma_len(sg));
+                    }
+                    if (rc < 0) {
+                        break;
+                    }
+                    off += sg_dma_len(sg);
+                }
+                *dma_ns += ktime_get_ns() - begin;
+                dma_unmap_sgtable(dma_dev, &sgt, dir, 0);
+            }
+            sg_free_table(&sgt);
+        }
+        if (!registered) {
+            unpin_user_pages_dirty_lock(pages, npages, !send);
+            kfree(pages);
+        }
+        if (rc < 0) {
+            // The copy of this segment is redone by the caller
+            caximem_warn("%s dma of user pages failed %d, fall back to bounce buffer.\n", send ? "send" : "recv", rc);
+            break;
+        }
+        iov_iter_advance(iter, seg);
+        done += seg;
+    }
+    up_read(&dev->pin_sem);
+    return done;
+}
+
+/**
+ * @brief pin a user buffer until it is unregistered or its file is closed
+ *
+ * @param dev The caximem device
+ * @param owner The file registering the buffer
+ * @param addr The user address of the buffer
+ * @param len The length of the buffer
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+int caximem_pin_register(struct caximem_device *dev, struct caximem_file *owner, unsigned long addr, size_t len) {
+    struct caximem_pinned *buf = NULL;
+    struct page **pages;
+    unsigned long nr_pages;
+    int npages, pinned = 0;
+    unsigned int i;
+    int rc;
+
+    if (addr == 0 || len == 0 || addr + len < addr) {
+        return -EINVAL;
+    }
+    // pin_user_pages_fast takes an int count
+    nr_pages = DIV_ROUND_UP(offset_in_page(addr) + len, PAGE_SIZE);
+    if (nr_pages > INT_MAX) {
+        return -EINVAL;
+    }
+    npages = nr_pages;
+    pages = kvmalloc_array(npages, sizeof(*pages), GFP_KERNEL);
+    if (pages == NULL) {
+        return -ENOMEM;
+    }
+    // Long term pins count against RLIMIT_MEMLOCK of the process
+    rc = account_locked_vm(current->mm, npages, true);
+    if (rc < 0) {
+        goto free_pages;
+    }
+    pinned = pin_user_pages_fast(addr & PAGE_MASK, npages, FOLL_WRITE | FOLL_LONGTERM, pages);
+    if (pinned != npages) {
+        rc = pinned < 0 ? pinned : -EFAULT;
+        goto unpin_pages;
+    }
+
+    down_write(&dev->pin_sem);
+    for (i = 0; i < CAXIMEM_PINNED_MAX; i++) {
+        if (dev->pinned[i].addr == 0) {
+            buf = &dev->pinned[i];
+            break;
+        }
+    }
+    if (buf == NULL) {
+        up_write(&dev->pin_sem);
+        rc = -ENOSPC;
+        goto unpin_pages;
+    }
+    buf->addr = addr;
+    buf->len = len;
+    buf->mm = current->mm;
+    mmgrab(buf->mm);
+    buf->owner = owner;
+    buf->pages = pages;
+    buf->npages = npages;
+    up_write(&dev->pin_sem);
+    return 0;
+
+unpin_pages:
+    if (pinned > 0) {
+        unpin_user_pages(pages, pinned);
+    }
+    account_locked_vm(current->mm, npages, false);
+free_pages:
+    kvfree(pages);
+    return rc;
+}
+
+static void caximem_pin_free(struct caximem_pinned *buf) {
+    unpin_user_pages_dirty_lock(buf->pages, buf->npages, true);
+    kvfree(buf->pages);
+    // The process may have exited already, its locked_vm is gone with it
+    if (mmget_not_zero(buf->mm)) {
+        account_locked_vm(buf->mm, buf->npages, false);
+        mmput(buf->mm);
+    }
+    mmdrop(buf->mm);
+    buf->addr = 0;
+    buf->len = 0;
+    buf->mm = NULL;
+    buf->owner = NULL;
+    buf->pages = NULL;
+    buf->npages = 0;
+}
+
+/**
+ * @brief unpin a buffer registered by caximem_pin_register
+ *
+ * @param dev The caximem device
+ * @param owner The file that registered the buffer
+ * @param addr The user address the buffer was registered with
+ * @return int Returns 0, or -ENOENT if the file registered no buffer at addr
+ */
+int caximem_pin_unregister(struct caximem_device *dev, struct caximem_file *owner, unsigned long addr) {
+    unsigned int i;
+    int rc = -ENOENT;
+    down_write(&dev->pin_sem);
+    for (i = 0; i < CAXIMEM_PINNED_MAX; i++) {
+        if (addr != 0 && dev->pinned[i].addr == addr && dev->pinned[i].owner == owner) {
+            caximem_pin_free(&dev->pinned[i]);
+            rc = 0;
+            break;
+        }
+    }
+    up_write(&dev->pin_sem);
+    return rc;
+}
+
+// Unpin the buffers registered by a file
+void caximem_pin_release(struct caximem_device *dev, struct caximem_file *owner) {
+    unsigned int i;
+    down_write(&dev->pin_sem);
+    for (i = 0; i < CAXIMEM_PINNED_MAX; i++) {
+        if (dev->pinned[i].addr != 0 && dev->pinned[i].owner == owner) {
+            caximem_pin_free(&dev->pinned[i]);
+        }
+    }
+    up_write(&dev->pin_sem);
+}
+
+static void caximem_copy_account(struct caximem_device *dev, bool send, enum caximem_copy_path copy_path,
+                                 size_t length, u64 busy_ns, u64 cpu_ns) {
+    struct caximem_copy_stats *stats = &dev->copy_stats[copy_path];
+    trace_caximem_copy_done(dev->dev_id, send, length, copy_path != CAXIMEM_COPY_CPU, busy_ns);
+    atomic64_inc(&stats->frames);
+    atomic64_add(length, &stats->bytes);
+    atomic64_add(busy_ns, &stats->busy_ns);
+    atomic64_add(cpu_ns, &stats->cpu_ns);
+}
+
+/**
+ * @brief copy into the send window with stores aligned to 64 bit
+ *
+ * @param dst The address in the send window
+ * @param src The data to copy
+ * @param length The number of bytes to copy
+ */
+static void caximem_burst_toio(void *dst, const void *src, size_t length) {
+    char *to = dst;
+    const char *from = src;
+    size_t body;
+
+    while (length && !IS_ALIGNED((unsigned long)to, sizeof(u64))) {
+        __raw_writeb(*from++, to++);
+        length--;
+    }
+    body = round_down(length, sizeof(u64));
+    length -= body;
+#ifdef CONFIG_64BIT
+    for (; body; body -= sizeof(u64)) {
+        __raw_writeq(get_unaligned((const u64 *)from), to);
+        from += sizeof(u64);
+        to += sizeof(u64);
+    }
+#else
+    memcpy_toio(to, from, body);
+    from += body;
+    to += body;
+#endif
+    while (length--) {
+        __raw_writeb(*from++, to++);
+    }
+}
+
+/**
+ * @brief copy frame data into a write-combining send window in bursts
+ *
+ * @param frame The address in the send window
+ * @param from The iterator of the frame data
+ * @param length The number of bytes to copy
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+static int caximem_burst_from_iter(char *frame, struct iov_iter *from, size_t length) {
+    u64 chunk[CAXIMEM_BURST_CHUNK / sizeof(u64)];
+    size_t n;
+
+    while (length) {
+        n = min_t(size_t, length, sizeof(chunk));
+        if (copy_from_iter(chunk, n, from) != n) {
+            return -EFAULT;
+        }
+        caximem_burst_toio(frame, chunk, n);
+        frame += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief copy frame data into the send slot filled next, after its control header
+ *
+ * @param dev The caximem device, the caller owns the send slot
+ * @param from The iterator of the frame data
+ * @param offset The offset in the frame to copy to
+ * @param length The number of bytes to copy
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+int caximem_copy_to_window(struct caximem_device *dev, struct iov_iter *from, size_t offset, size_t length) {
+    struct caximem_dma_path *path = &dev->send_dma;
+    struct device *dma_dev;
+    dma_addr_t addr;
+    u64 start, end, cpu_ns, dma_ns;
+    size_t done;
+    char *frame;
+    int rc;
+
+    // The frame goes after the info reg of the send slot filled next
+    frame = (char *)dev->send_info_reg + sizeof(caximem_ctrl_t) + offset;
+    start = ktime_get_ns();
+    if (caximem_pin_use(dev, path, from, length)) {
+        done = caximem_dma_user(dev, path, from, path->window + (frame - (char *)dev->send_buffer), length, true,
+                                &dma_ns);
+        if (done) {
+            end = ktime_get_ns();
+            caximem_copy_account(dev, true, CAXIMEM_COPY_PIN, done, end - start, end - start - dma_ns);
+            frame += done;
+            length -= done;
+            if (length == 0) {
+                return 0;
+            }
+            start = end;
+        }
+    }
+    if (!caximem_dma_use(dev, path, length)) {
+        if (dev->send_wc) {
+            rc = caximem_burst_from_iter(frame, from, length);
+            if (rc < 0) {
+                return rc;
+            }
+        } else if (copy_from_iter(frame, length, from) != length) {
+            return -EFAULT;
+        }
+        cpu_ns = ktime_get_ns() - start;
+        caximem_copy_account(dev, true, CAXIMEM_COPY_CPU, length, cpu_ns, cpu_ns);
+        return 0;
+    }
+
+    if (copy_from_iter(path->bounce, length, from) != length) {
+        return -EFAULT;
+    }
+    dma_dev = path->chan->device->dev;
+    addr = dma_map_single(dma_dev, path->bounce, length, DMA_TO_DEVICE);
+    if (dma_mapping_error(dma_dev, addr)) {
+        rc = -ENOMEM;
+    } else {
+        cpu_ns = ktime_get_ns() - start;
+        rc = caximem_dma_memcpy(path, path->window + (frame - (char *)dev->send_buffer), addr, length);
+        dma_unmap_single(dma_dev, addr, length, DMA_TO_DEVICE);
+    }
+    if (rc < 0) {
+        // The data is already in the bounce buffer, finish with the CPU
+        caximem_warn("send dma failed %d, fall back to cpu copy.\n", rc);
+        caximem_burst_toio(frame, path->bounce, length);
+        cpu_ns = ktime_get_ns() - start;
+        caximem_copy_account(dev, true, CAXIMEM_COPY_CPU, length, cpu_ns, cpu_ns);
+        return 0;
+    }
+    caximem_copy_account(dev, true, CAXIMEM_COPY_DMA, length, ktime_get_ns() - start, cpu_ns);
+    return 0;
+}
+
+/**
+ * @brief copy frame data out of the recv window after the control header
+ *
+ * @param dev The caximem device, the caller owns the recv window
+ * @param to The iterator to store the frame data
+ * @param offset The offset in the frame to copy from
+ * @param length The number of bytes to copy
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+int caximem_copy_from_window(struct caximem_device *dev, struct iov_iter *to, size_t offset, size_t length) {
+    struct caximem_dma_path *path = &dev->recv_dma;
+    struct device *dma_dev;
+    dma_addr_t addr;
+    u64 start, copy_start, end, cpu_ns, dma_ns;
+    size_t done;
+    char *frame;
+    int rc;
+
+    frame = (char *)dev->recv_buffer + sizeof(caximem_ctrl_t) + offset;
+    start = ktime_get_ns();
+    if (caximem_pin_use(dev, path, to, length)) {
+        done = caximem_dma_user(dev, path, to, path->window + (frame - (char *)dev->recv_buffer), length, false,
+                                &dma_ns);
+        if (done) {
+            end = ktime_get_ns();
+            caximem_copy_account(dev, false, CAXIMEM_COPY_PIN, done, end - start, end - start - dma_ns);
+            frame += done;
+            length -= done;
+            if (length == 0) {
+                return 0;
+            }
+            start = end;
+        }
+    }
+    if (!caximem_dma_use(dev, path, length)) {
+        if (copy_to_iter(frame, length, to) != length) {
+            return -EFAULT;
+        }
+        cpu_ns = ktime_get_ns() - start;
+        caximem_copy_account(dev, false, CAXIMEM_COPY_CPU, length, cpu_ns, cpu_ns);
+        return 0;
+    }
+
+    cpu_ns = 0;
+    dma_dev = path->chan->device->dev;
+    addr = dma_map_single(dma_dev, path->bounce, length, DMA_FROM_DEVICE);
+    if (dma_mapping_error(dma_dev, addr)) {
+        rc = -ENOMEM;
+    } else {
+        cpu_ns = ktime_get_ns() - start;
+        rc = caximem_dma_memcpy(path, addr, path->window + (frame - (char *)dev->recv_buffer), length);
+        dma_unmap_single(dma_dev, addr, length, DMA_FROM_DEVICE);
+    }
+    if (rc < 0) {
+        caximem_warn("recv dma failed %d, fall back to cpu copy.\n", rc);
+        memcpy_fromio(path->bounce, frame, length);
+    }
+    copy_start = ktime_get_ns();
+    if (copy_to_iter(path->bounce, length, to) != length) {
+        return -EFAULT;
+    }
+    end = ktime_get_ns();
+    if (rc < 0) {
+        caximem_copy_account(dev, false, CAXIMEM_COPY_CPU, length, end - start, end - start);
+    } else {
+        // The CPU only sets up the dma and copies out of the bounce buffer
+        caximem_copy_account(dev, false, CAXIMEM_COPY_DMA, length, end - start, cpu_ns + end - copy_start);
+    }
+    return 0;
+}
+
+/**
+ * @brief set up dma for both windows, without a channel the CPU copies everything
+ *
+ * @param dev The caximem device
+ */
+void caximem_dma_init(struct caximem_device *dev) {
+    if (dev->sim) {
+        // The simulated windows are RAM, there is no device memory to map
+        return;
+    }
+    if (caximem_dma_path_init(dev, &dev->send_dma, "tx", dev->send_offset, dev->send_max_size) < 0) {
+        caximem_info("no send dma channel, frames are copied by the cpu.\n");
+    }
+    if (caximem_dma_path_init(dev, &dev->recv_dma, "rx", dev->recv_offset, dev->recv_max_size) < 0) {
+        caximem_info("no recv dma channel, frames are copied by the cpu.\n");
+    }
+}
+
+// Release the dma channels and bounce buffers
+void caximem_dma_exit(struct caximem_device *dev) {
+    caximem_dma_path_exit(&dev->recv_dma, dev->recv_max_size);
+    caximem_dma_path_exit(&dev->send_dma, dev->send_max_size);
+}
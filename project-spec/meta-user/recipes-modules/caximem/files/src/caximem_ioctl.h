@@ -11,10 +11,195 @@
 #ifndef CAXIMEM_IOCTL_H_
 #define CAXIMEM_IOCTL_H_
 
+#include <linux/types.h>
 #include <asm/ioctl.h>
 
 #define CAXIMEM_IOCTL_MAGIC 'W'
 
+/**
+ * mmap offsets of the send and recv windows, the whole window is mapped and
+ * frame data starts at data_offset (right after the control header)
+ */
+#define CAXIMEM_MMAP_SEND_OFFSET 0x00000000ul
+#define CAXIMEM_MMAP_RECV_OFFSET 0x01000000ul
+#define CAXIMEM_MMAP_URING_OFFSET 0x02000000ul
+
+struct caximem_info
+{
+    __u32 send_size;      // The size of the send window
+    __u32 recv_size;      // The size of the recv window
+    __u32 data_offset;    // The offset of frame data in both windows
+    __u32 send_max_frame; // The maximum frame size for sending
+    __u32 recv_max_frame; // The maximum frame size for recving
+};
+
+/**
+ * frame descriptor of CAXIMEM_SEND_MMSG / CAXIMEM_RECV_MMSG
+ */
+struct caximem_mmsg
+{
+    __u64 ptr;      // The user buffer of the frame
+    __u32 len;      // The buffer length, updated with the number of bytes transferred
+    __u32 flags;    // CAXIMEM_MSG_* flags
+    __s32 status;   // 0, or error code less than 0 of this frame
+    __u32 reserved; // Reserved, set to 0
+};
+
+#define CAXIMEM_MSG_DONTWAIT 0x1 // Do not block for this frame
+#define CAXIMEM_MSG_TRUNC 0x2    // Returned if the frame did not fit into len
+
+struct caximem_mmsg_batch
+{
+    __u64 msgs;  // The user array of struct caximem_mmsg
+    __u32 count; // The number of frames in msgs, at most CAXIMEM_MMSG_MAX
+    __u32 flags; // CAXIMEM_MMSG_* flags
+};
+
+#define CAXIMEM_MMSG_WAITFORONE 0x1 // Only block for the first frame
+#define CAXIMEM_MMSG_MAX 64
+
+/**
+ * fragment header of the message mode (msg_max_size module parameter)
+ *
+ * Each frame starts with this header right after the control header, so a
+ * message larger than the window is sent as several frames. Frames mapped
+ * with mmap must carry it too when the peer runs in message mode.
+ */
+struct caximem_frag_hdr
+{
+    __u32 flags;   // CAXIMEM_FRAG_* flags
+    __u32 msg_len; // The length of the whole message
+};
+
+#define CAXIMEM_FRAG_FIRST 0x1 // The first fragment of a message
+#define CAXIMEM_FRAG_LAST 0x2  // The last fragment of a message
+
+/**
+ * record header of the batch mode (batch_frames module parameter)
+ *
+ * A frame carries several messages, each one this header followed by len
+ * bytes and padded to CAXIMEM_BATCH_ALIGN. The frame size in the control
+ * header ends at the last byte of the last message.
+ */
+struct caximem_batch_rec
+{
+    __u32 len; // The length of the message after this header
+};
+
+#define CAXIMEM_BATCH_ALIGN 4
+
+/**
+ * user buffer of CAXIMEM_REGISTER_BUF / CAXIMEM_UNREGISTER_BUF
+ *
+ * The pages of a registered buffer stay pinned, so reads and writes from
+ * inside it skip pinning when they take the zero-copy dma path.
+ */
+struct caximem_buf
+{
+    __u64 addr; // The user address of the buffer
+    __u64 len;  // The length of the buffer, ignored by CAXIMEM_UNREGISTER_BUF
+};
+
+/**
+ * eventfds of CAXIMEM_SET_EVENTFD, -1 detaches the eventfd of that direction
+ */
+struct caximem_eventfd
+{
+    __s32 send_fd; // Signaled each time a frame has been sent
+    __s32 recv_fd; // Signaled each time a frame can be read
+};
+
+/**
+ * submission and completion rings of CAXIMEM_URING_SETUP
+ *
+ * The region mapped at CAXIMEM_MMAP_URING_OFFSET starts with struct
+ * caximem_uring_ring, followed by the submission entries at sq_off, the
+ * completion entries at cq_off and buf_count frame buffers of buf_size bytes
+ * at buf_off. User space fills a caximem_sqe at sq_tail & sq_mask and then
+ * advances sq_tail, the driver consumes it and posts a caximem_cqe at
+ * cq_tail. The driver picks up new entries on each interrupt, so the rings
+ * only need CAXIMEM_URING_ENTER while CAXIMEM_URING_NEED_WAKEUP is set or to
+ * sleep until completions arrive.
+ */
+struct caximem_uring_params
+{
+    __u32 sq_entries; // The number of submission entries, rounded up to a power of two
+    __u32 cq_entries; // The number of completion entries, rounded up to a power of two
+    __u32 buf_count;  // The number of frame buffers
+    __u32 buf_size;   // Returns the size of each frame buffer
+    __u32 sq_off;     // Returns the offset of the submission entries
+    __u32 cq_off;     // Returns the offset of the completion entries
+    __u32 buf_off;    // Returns the offset of the frame buffers
+    __u32 size;       // Returns the size of the region to map
+};
+
+struct caximem_uring_ring
+{
+    __u32 sq_head; // The next submission entry the driver consumes
+    __u32 sq_tail; // The next submission entry user space fills
+    __u32 cq_head; // The next completion entry user space consumes
+    __u32 cq_tail; // The next completion entry the driver fills
+    __u32 sq_mask; // sq_entries - 1
+    __u32 cq_mask; // cq_entries - 1
+    __u32 flags;   // CAXIMEM_URING_* flags set by the driver
+    __u32 dropped; // The number of completions dropped on a full completion ring
+};
+
+#define CAXIMEM_URING_NEED_WAKEUP 0x1 // New submissions are only seen after CAXIMEM_URING_ENTER
+
+struct caximem_sqe
+{
+    __u8 opcode;     // CAXIMEM_OP_*
+    __u8 flags;      // Reserved, set to 0
+    __u16 buf_index; // The frame buffer to send from or receive into
+    __u32 len;       // The frame length to send, or the buffer length to receive into
+    __u64 user_data; // Copied into the completion
+};
+
+#define CAXIMEM_OP_SEND 0
+#define CAXIMEM_OP_RECV 1
+
+struct caximem_cqe
+{
+    __u64 user_data;   // The user_data of the submission
+    __s32 res;         // The number of bytes transferred, or error code less than 0
+    __u32 flags;       // CAXIMEM_CQE_* flags
+    __u64 submit_ns;   // The time the driver consumed the submission
+    __u64 complete_ns; // The time of the interrupt completing it
+};
+
+#define CAXIMEM_CQE_TRUNC 0x1 // The received frame did not fit into len
+
+struct caximem_uring_enter
+{
+    __u32 min_complete; // Sleep until this many completions are waiting, 0 to only kick the driver
+    __u32 flags;        // Reserved, set to 0
+};
+
+/**
+ * request and response of CAXIMEM_TRANSACT
+ */
+struct caximem_transact
+{
+    __u64 req;      // The user buffer of the request
+    __u64 resp;     // The user buffer for the response
+    __u32 req_len;  // The request length
+    __u32 resp_len; // The response buffer length, updated with the number of bytes received
+    __u32 flags;    // CAXIMEM_MSG_TRUNC is returned if the response did not fit into resp_len
+    __u32 reserved; // Reserved, set to 0
+};
+
 #define CAXIMEM_CANCEL _IO(CAXIMEM_IOCTL_MAGIC, 0)
+#define CAXIMEM_GET_INFO _IOR(CAXIMEM_IOCTL_MAGIC, 1, struct caximem_info)
+#define CAXIMEM_SEND_COMMIT _IOW(CAXIMEM_IOCTL_MAGIC, 2, __u32)
+#define CAXIMEM_RECV_COMMIT _IOR(CAXIMEM_IOCTL_MAGIC, 3, __u32)
+#define CAXIMEM_SEND_MMSG _IOW(CAXIMEM_IOCTL_MAGIC, 4, struct caximem_mmsg_batch)
+#define CAXIMEM_RECV_MMSG _IOW(CAXIMEM_IOCTL_MAGIC, 5, struct caximem_mmsg_batch)
+#define CAXIMEM_REGISTER_BUF _IOW(CAXIMEM_IOCTL_MAGIC, 6, struct caximem_buf)
+#define CAXIMEM_UNREGISTER_BUF _IOW(CAXIMEM_IOCTL_MAGIC, 7, struct caximem_buf)
+#define CAXIMEM_SET_EVENTFD _IOW(CAXIMEM_IOCTL_MAGIC, 8, struct caximem_eventfd)
+#define CAXIMEM_URING_SETUP _IOWR(CAXIMEM_IOCTL_MAGIC, 9, struct caximem_uring_params)
+#define CAXIMEM_URING_ENTER _IOW(CAXIMEM_IOCTL_MAGIC, 10, struct caximem_uring_enter)
+#define CAXIMEM_TRANSACT _IOWR(CAXIMEM_IOCTL_MAGIC, 11, struct caximem_transact)
 
-#endif
\ No newline at end of file
+#endif
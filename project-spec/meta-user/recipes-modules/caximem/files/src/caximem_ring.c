@@ -0,0 +1,108 @@
+/**
+ * @file caximem_ring.c
+ * @author wlanxww (xueweiwujxw@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-10-12
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+
+#include "caximem.h"
+
+/**
+ * Frame ring with one producer and one consumer
+ *
+ * head and tail are free running counters, the producer publishes a slot by
+ * advancing head and the consumer gives it back by advancing tail, so no lock
+ * is needed as long as each side is serialized on its own.
+ */
+
+/**
+ * @brief allocate the slots of a frame ring
+ *
+ * @param ring The ring to initialize
+ * @param slots The number of slots, rounded up to a power of two
+ * @param slot_size The size of each slot
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+int caximem_ring_init(struct caximem_ring *ring, unsigned int slots, size_t slot_size) {
+    ring->slots = roundup_pow_of_two(slots);
+    ring->slot_size = slot_size;
+    ring->len = kcalloc(ring->slots, sizeof(*ring->len), GFP_KERNEL);
+    if (ring->len == NULL) {
+        return -ENOMEM;
+    }
+    ring->data = kvmalloc_array(ring->slots, slot_size, GFP_KERNEL);
+    if (ring->data == NULL) {
+        kfree(ring->len);
+        ring->len = NULL;
+        return -ENOMEM;
+    }
+    caximem_ring_reset(ring);
+    return 0;
+}
+
+// Free the slots of a frame ring
+void caximem_ring_free(struct caximem_ring *ring) {
+    kvfree(ring->data);
+    kfree(ring->len);
+    ring->data = NULL;
+    ring->len = NULL;
+}
+
+// Drop all frames, neither side may use the ring concurrently
+void caximem_ring_reset(struct caximem_ring *ring) {
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+// Check if there is no frame to consume
+bool caximem_ring_empty(struct caximem_ring *ring) {
+    return smp_load_acquire(&ring->head) == READ_ONCE(ring->tail);
+}
+
+// Check if there is no free slot to produce into
+bool caximem_ring_full(struct caximem_ring *ring) {
+    return READ_ONCE(ring->head) - smp_load_acquire(&ring->tail) >= ring->slots;
+}
+
+// Get the slot to produce into, only valid if the ring is not full
+void *caximem_ring_head(struct caximem_ring *ring) {
+    return ring->data + (ring->head & (ring->slots - 1)) * ring->slot_size;
+}
+
+// Publish the slot returned by caximem_ring_head with a frame of len bytes
+void caximem_ring_push(struct caximem_ring *ring, size_t len) {
+    ring->len[ring->head & (ring->slots - 1)] = len;
+    smp_store_release(&ring->head, ring->head + 1);
+}
+
+// Get the oldest frame and its length, only valid if the ring is not empty
+void *caximem_ring_tail(struct caximem_ring *ring, size_t *len) {
+    unsigned int index = ring->tail & (ring->slots - 1);
+    *len = ring->len[index];
+    return ring->data + index * ring->slot_size;
+}
+
+// Give the slot returned by caximem_ring_tail back to the producer
+void caximem_ring_pop(struct caximem_ring *ring) {
+    smp_store_release(&ring->tail, ring->tail + 1);
+}
+
+// Get the number of frames to consume
+unsigned int caximem_ring_count(struct caximem_ring *ring) {
+    return smp_load_acquire(&ring->head) - READ_ONCE(ring->tail);
+}
+
+// Get the i-th oldest frame and its length, only valid if i is less than the count
+void *caximem_ring_peek(struct caximem_ring *ring, unsigned int i, size_t *len) {
+    unsigned int index = (ring->tail + i) & (ring->slots - 1);
+    *len = ring->len[index];
+    return ring->data + index * ring->slot_size;
+}
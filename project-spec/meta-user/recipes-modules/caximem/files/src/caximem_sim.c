@@ -0,0 +1,275 @@
+/**
+ * @file caximem_sim.c
+ * @author wlanxww (xueweiwujxw@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-10-26
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/gfp.h>
+#include <linux/io.h>
+
+#include "caximem.h"
+
+/**
+ * Software loopback backend
+ *
+ * With sim=1 the module registers a "caximem" platform device whose send and
+ * recv windows live in kernel memory. An hrtimer plays the PL: after the
+ * configured latency plus size / bandwidth it clears the send enable and
+ * raises the send interrupt. With sim_loopback the frame is copied into the
+ * armed recv window and the recv interrupt is raised. While the recv window
+ * is not armed the frame stays on the "wire" and the send does not complete,
+ * as the PL would hold it.
+ */
+
+#define CAXIMEM_SIM_NAME "caximem_sim"
+
+static unsigned int sim = 0;
+module_param(sim, uint, S_IRUGO);
+MODULE_PARM_DESC(sim, "Register a software loopback device instead of using the FPGA (0: disabled)");
+static unsigned int sim_window_size = 0x10000;
+module_param(sim_window_size, uint, S_IRUGO);
+MODULE_PARM_DESC(sim_window_size, "The size of each simulated BRAM window in bytes");
+static unsigned int sim_latency_ns = 2000;
+module_param(sim_latency_ns, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sim_latency_ns, "The time from the doorbell to the simulated send interrupt");
+static unsigned int sim_bandwidth = 0;
+module_param(sim_bandwidth, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sim_bandwidth, "The simulated link bandwidth in MB/s (0: unlimited)");
+static unsigned int sim_loopback = 1;
+module_param(sim_loopback, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sim_loopback, "Deliver sent frames to the recv window (0: drop them)");
+
+struct caximem_sim
+{
+    struct caximem_device *dev; // The caximem device driven by the backend
+    void *send_bram;            // The simulated send window
+    void *recv_bram;            // The simulated recv window
+    irq_handler_t send_irq;     // The send interrupt handler of the driver
+    irq_handler_t recv_irq;     // The recv interrupt handler of the driver
+    struct hrtimer send_timer;  // Completes the frame in the send window
+    struct hrtimer recv_timer;  // Delivers a frame waiting for the recv window
+    spinlock_t lock;            // Serializes the two timers
+    bool wire;                  // Whether a sent frame waits for the recv window
+};
+
+static struct platform_device *caximem_sim_pdev;
+
+/**
+ * @brief copy the frame in the send window into the recv window if it is armed
+ *
+ * @param sim The backend, lock must be held
+ * @return bool Returns true if the frame was delivered
+ */
+static bool caximem_sim_deliver(struct caximem_sim *sim) {
+    struct caximem_device *dev = sim->dev;
+    caximem_ctrl_t send_info, recv_info;
+    unsigned int length;
+    memcpy(&recv_info, sim->recv_bram, sizeof(caximem_ctrl_t));
+    if (!recv_info.enable || recv_info.size != 0) {
+        return false;
+    }
+    memcpy(&send_info, sim->send_bram, sizeof(caximem_ctrl_t));
+    length = min_t(unsigned int, send_info.size, dev->recv_max_size - sizeof(caximem_ctrl_t));
+    memcpy((char *)sim->recv_bram + sizeof(caximem_ctrl_t), (char *)sim->send_bram + sizeof(caximem_ctrl_t), length);
+    recv_info.size = length;
+    memcpy(sim->recv_bram, &recv_info, sizeof(caximem_ctrl_t));
+    return true;
+}
+
+// Clear the send enable as the PL does when the frame has been sent
+static void caximem_sim_send_done(struct caximem_sim *sim) {
+    caximem_ctrl_t send_info;
+    memcpy(&send_info, sim->send_bram, sizeof(caximem_ctrl_t));
+    send_info.enable = false;
+    memcpy(sim->send_bram, &send_info, sizeof(caximem_ctrl_t));
+}
+
+static enum hrtimer_restart caximem_sim_send_timer(struct hrtimer *timer) {
+    struct caximem_sim *sim = container_of(timer, struct caximem_sim, send_timer);
+    caximem_ctrl_t send_info;
+    bool delivered = false;
+    spin_lock(&sim->lock);
+    memcpy(&send_info, sim->send_bram, sizeof(caximem_ctrl_t));
+    if (!send_info.enable) {
+        // Canceled before it was sent
+        spin_unlock(&sim->lock);
+        return HRTIMER_NORESTART;
+    }
+    if (READ_ONCE(sim_loopback)) {
+        delivered = caximem_sim_deliver(sim);
+        if (!delivered) {
+            sim->wire = true;
+            spin_unlock(&sim->lock);
+            return HRTIMER_NORESTART;
+        }
+    }
+    caximem_sim_send_done(sim);
+    spin_unlock(&sim->lock);
+    sim->send_irq(0, sim->dev);
+    if (delivered) {
+        sim->recv_irq(0, sim->dev);
+    }
+    return HRTIMER_NORESTART;
+}
+
+static enum hrtimer_restart caximem_sim_recv_timer(struct hrtimer *timer) {
+    struct caximem_sim *sim = container_of(timer, struct caximem_sim, recv_timer);
+    caximem_ctrl_t send_info;
+    bool delivered = false;
+    spin_lock(&sim->lock);
+    if (sim->wire) {
+        memcpy(&send_info, sim->send_bram, sizeof(caximem_ctrl_t));
+        if (!send_info.enable) {
+            sim->wire = false;
+        } else if (caximem_sim_deliver(sim)) {
+            caximem_sim_send_done(sim);
+            sim->wire = false;
+            delivered = true;
+        }
+    }
+    spin_unlock(&sim->lock);
+    if (delivered) {
+        sim->send_irq(0, sim->dev);
+        sim->recv_irq(0, sim->dev);
+    }
+    return HRTIMER_NORESTART;
+}
+
+/**
+ * @brief play the PL reacting to a write of a control register
+ *
+ * @param dev The caximem device
+ * @param send true for the send doorbell, false when the recv window is armed
+ */
+void caximem_sim_doorbell(struct caximem_device *dev, bool send) {
+    struct caximem_sim *sim = dev->sim;
+    unsigned int bandwidth;
+    u64 delay;
+    if (!send) {
+        hrtimer_start(&sim->recv_timer, 0, HRTIMER_MODE_REL_HARD);
+        return;
+    }
+    delay = READ_ONCE(sim_latency_ns);
+    bandwidth = READ_ONCE(sim_bandwidth);
+    if (bandwidth) {
+        // bytes / (MB/s) = bytes * 1000 / bandwidth ns
+        delay += div_u64((u64)dev->send_info.size * 1000, bandwidth);
+    }
+    hrtimer_start(&sim->send_timer, ns_to_ktime(delay), HRTIMER_MODE_REL_HARD);
+}
+
+/**
+ * @brief set up a caximem device for the simulated platform device
+ *
+ * @param dev The caximem device, pdev is set
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+int caximem_sim_probe(struct caximem_device *dev) {
+    struct caximem_sim *sim;
+    unsigned long size;
+
+    size = PAGE_ALIGN(clamp_t(unsigned long, sim_window_size, PAGE_SIZE, 1ul << 24));
+    sim = kzalloc(sizeof(*sim), GFP_KERNEL);
+    if (sim == NULL) {
+        return -ENOMEM;
+    }
+    sim->send_bram = alloc_pages_exact(size, GFP_KERNEL | __GFP_ZERO);
+    if (sim->send_bram == NULL) {
+        goto free_sim;
+    }
+    sim->recv_bram = alloc_pages_exact(size, GFP_KERNEL | __GFP_ZERO);
+    if (sim->recv_bram == NULL) {
+        goto free_send_bram;
+    }
+    spin_lock_init(&sim->lock);
+    hrtimer_init(&sim->send_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+    sim->send_timer.function = caximem_sim_send_timer;
+    hrtimer_init(&sim->recv_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+    sim->recv_timer.function = caximem_sim_recv_timer;
+    sim->dev = dev;
+
+    // The windows are RAM, mmap maps them by their physical address
+    dev->sim = sim;
+    dev->dev_name = CAXIMEM_SIM_NAME;
+    dev->dev_id = 0;
+    dev->send_offset = virt_to_phys(sim->send_bram);
+    dev->send_max_size = size;
+    dev->recv_offset = virt_to_phys(sim->recv_bram);
+    dev->recv_max_size = size;
+    caximem_info("simulated windows %08lx %08lx %08lx\n", dev->send_offset, dev->recv_offset, size);
+    return 0;
+
+free_send_bram:
+    free_pages_exact(sim->send_bram, size);
+free_sim:
+    kfree(sim);
+    return -ENOMEM;
+}
+
+void caximem_sim_remove(struct caximem_device *dev) {
+    struct caximem_sim *sim = dev->sim;
+    if (sim == NULL) {
+        return;
+    }
+    free_pages_exact(sim->recv_bram, dev->recv_max_size);
+    free_pages_exact(sim->send_bram, dev->send_max_size);
+    kfree(sim);
+    dev->sim = NULL;
+}
+
+/**
+ * @brief use the simulated windows and interrupts instead of the FPGA
+ *
+ * @param dev The caximem device
+ * @param send_irq The send interrupt handler
+ * @param recv_irq The recv interrupt handler
+ */
+void caximem_sim_attach(struct caximem_device *dev, irq_handler_t send_irq, irq_handler_t recv_irq) {
+    struct caximem_sim *sim = dev->sim;
+    sim->send_irq = send_irq;
+    sim->recv_irq = recv_irq;
+    sim->wire = false;
+    dev->send_buffer = sim->send_bram;
+    dev->recv_buffer = sim->recv_bram;
+}
+
+void caximem_sim_detach(struct caximem_device *dev) {
+    hrtimer_cancel(&dev->sim->send_timer);
+    hrtimer_cancel(&dev->sim->recv_timer);
+}
+
+// Register the simulated platform device if sim is set
+int caximem_sim_register(void) {
+    if (!sim) {
+        return 0;
+    }
+    caximem_sim_pdev = platform_device_register_data(NULL, MODULE_NAME, PLATFORM_DEVID_NONE, NULL, 0);
+    if (IS_ERR(caximem_sim_pdev)) {
+        caximem_err("failed to register the simulated device.\n");
+        return PTR_ERR(caximem_sim_pdev);
+    }
+    return 0;
+}
+
+void caximem_sim_unregister(void) {
+    if (!IS_ERR_OR_NULL(caximem_sim_pdev)) {
+        platform_device_unregister(caximem_sim_pdev);
+    }
+    caximem_sim_pdev = NULL;
+}
+
+// Check if the platform device was registered by caximem_sim_register
+bool caximem_sim_match(struct platform_device *pdev) {
+    return pdev == caximem_sim_pdev;
+}
@@ -0,0 +1,303 @@
+/**
+ * @file caximem_sysfs.c
+ * @author wlanxww (xueweiwujxw@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-10-20
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/sysfs.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/bitops.h>
+
+#include "caximem.h"
+
+/**
+ * Attributes of /sys/class/<dev_name>/<dev_name>_<id>
+ */
+
+static ssize_t dma_threshold_show(struct device *device, struct device_attribute *attr, char *buf) {
+    struct caximem_device *caximem_dev = dev_get_drvdata(device);
+    return sysfs_emit(buf, "%u\n", READ_ONCE(caximem_dev->dma_threshold));
+}
+
+static ssize_t dma_threshold_store(struct device *device, struct device_attribute *attr, const char *buf, size_t count) {
+    struct caximem_device *caximem_dev = dev_get_drvdata(device);
+    unsigned int threshold;
+    int rc;
+    rc = kstrtouint(buf, 0, &threshold);
+    if (rc < 0) {
+        return rc;
+    }
+    WRITE_ONCE(caximem_dev->dma_threshold, threshold);
+    return count;
+}
+static DEVICE_ATTR_RW(dma_threshold);
+
+static ssize_t pin_threshold_show(struct device *device, struct device_attribute *attr, char *buf) {
+    struct caximem_device *caximem_dev = dev_get_drvdata(device);
+    return sysfs_emit(buf, "%u\n", READ_ONCE(caximem_dev->pin_threshold));
+}
+
+static ssize_t pin_threshold_store(struct device *device, struct device_attribute *attr, const char *buf, size_t count) {
+    struct caximem_device *caximem_dev = dev_get_drvdata(device);
+    unsigned int threshold;
+    int rc;
+    rc = kstrtouint(buf, 0, &threshold);
+    if (rc < 0) {
+        return rc;
+    }
+    WRITE_ONCE(caximem_dev->pin_threshold, threshold);
+    return count;
+}
+static DEVICE_ATTR_RW(pin_threshold);
+
+static ssize_t busy_poll_us_show(struct device *device, struct device_attribute *attr, char *buf) {
+    struct caximem_device *caximem_dev = dev_get_drvdata(device);
+    return sysfs_emit(buf, "%u\n", READ_ONCE(caximem_dev->busy_poll_us));
+}
+
+static ssize_t busy_poll_us_store(struct device *device, struct device_attribute *attr, const char *buf, size_t count) {
+    struct caximem_device *caximem_dev = dev_get_drvdata(device);
+    unsigned int budget;
+    int rc;
+    rc = kstrtouint(buf, 0, &budget);
+    if (rc < 0) {
+        return rc;
+    }
+    WRITE_ONCE(caximem_dev->busy_poll_us, budget);
+    return count;
+}
+static DEVICE_ATTR_RW(busy_poll_us);
+
+static ssize_t irq_cpu_show(struct device *device, struct device_attribute *attr, char *buf) {
+    struct caximem_device *caximem_dev = dev_get_drvdata(device);
+    return sysfs_emit(buf, "%d\n", READ_ONCE(caximem_dev->irq_cpu));
+}
+
+static ssize_t irq_cpu_store(struct device *device, struct device_attribute *attr, const char *buf, size_t count) {
+    struct caximem_device *caximem_dev = dev_get_drvdata(device);
+    int cpu, old;
+    int rc;
+    rc = kstrtoint(buf, 0, &cpu);
+    if (rc < 0) {
+        return rc;
+    }
+    old = READ_ONCE(caximem_dev->irq_cpu);
+    WRITE_ONCE(caximem_dev->irq_cpu, cpu);
+    rc = caximem_irq_affinity(caximem_dev);
+    if (rc < 0) {
+        WRITE_ONCE(caximem_dev->irq_cpu, old);
+        caximem_irq_affinity(caximem_dev);
+        return rc;
+    }
+    return count;
+}
+static DEVICE_ATTR_RW(irq_cpu);
+
+static ssize_t irq_prio_show(struct device *device, struct device_attribute *attr, char *buf) {
+    struct caximem_device *caximem_dev = dev_get_drvdata(device);
+    return sysfs_emit(buf, "%u\n", READ_ONCE(caximem_dev->irq_prio));
+}
+
+static ssize_t irq_prio_store(struct device *device, struct device_attribute *attr, const char *buf, size_t count) {
+    struct caximem_device *caximem_dev = dev_get_drvdata(device);
+    unsigned int prio;
+    int rc;
+    rc = kstrtouint(buf, 0, &prio);
+    if (rc < 0) {
+        return rc;
+    }
+    if (prio >= MAX_RT_PRIO) {
+        return -EINVAL;
+    }
+    // Taken over by the interrupt threads at their next interrupt
+    WRITE_ONCE(caximem_dev->irq_prio, prio);
+    atomic_inc(&caximem_dev->irq_prio_gen);
+    return count;
+}
+static DEVICE_ATTR_RW(irq_prio);
+
+static ssize_t write_combine_show(struct device *device, struct device_attribute *attr, char *buf) {
+    struct caximem_device *caximem_dev = dev_get_drvdata(device);
+    return sysfs_emit(buf, "%d\n", caximem_dev->send_wc);
+}
+static DEVICE_ATTR_RO(write_combine);
+
+static struct attribute *caximem_attrs[] = {
+    &dev_attr_dma_threshold.attr,
+    &dev_attr_pin_threshold.attr,
+    &dev_attr_busy_poll_us.attr,
+    &dev_attr_write_combine.attr,
+    &dev_attr_irq_cpu.attr,
+    &dev_attr_irq_prio.attr,
+    NULL,
+};
+
+static const struct attribute_group caximem_attr_group = {
+    .attrs = caximem_attrs,
+};
+
+/**
+ * Statistics of each copy path in the copy/ directory
+ */
+
+#define CAXIMEM_COPY_ATTR(_path, _name, _field)                                                      \
+    static ssize_t _name##_show(struct device *device, struct device_attribute *attr, char *buf) {   \
+        struct caximem_device *caximem_dev = dev_get_drvdata(device);                               \
+        return sysfs_emit(buf, "%lld\n", (long long)atomic64_read(&caximem_dev->copy_stats[_path]._field)); \
+    }                                                                                                \
+    static DEVICE_ATTR_RO(_name)
+
+CAXIMEM_COPY_ATTR(CAXIMEM_COPY_CPU, cpu_frames, frames);
+CAXIMEM_COPY_ATTR(CAXIMEM_COPY_CPU, cpu_bytes, bytes);
+CAXIMEM_COPY_ATTR(CAXIMEM_COPY_CPU, cpu_busy_ns, busy_ns);
+CAXIMEM_COPY_ATTR(CAXIMEM_COPY_CPU, cpu_cpu_ns, cpu_ns);
+CAXIMEM_COPY_ATTR(CAXIMEM_COPY_DMA, dma_frames, frames);
+CAXIMEM_COPY_ATTR(CAXIMEM_COPY_DMA, dma_bytes, bytes);
+CAXIMEM_COPY_ATTR(CAXIMEM_COPY_DMA, dma_busy_ns, busy_ns);
+CAXIMEM_COPY_ATTR(CAXIMEM_COPY_DMA, dma_cpu_ns, cpu_ns);
+CAXIMEM_COPY_ATTR(CAXIMEM_COPY_PIN, pin_frames, frames);
+CAXIMEM_COPY_ATTR(CAXIMEM_COPY_PIN, pin_bytes, bytes);
+CAXIMEM_COPY_ATTR(CAXIMEM_COPY_PIN, pin_busy_ns, busy_ns);
+CAXIMEM_COPY_ATTR(CAXIMEM_COPY_PIN, pin_cpu_ns, cpu_ns);
+
+static struct attribute *caximem_copy_attrs[] = {
+    &dev_attr_cpu_frames.attr,
+    &dev_attr_cpu_bytes.attr,
+    &dev_attr_cpu_busy_ns.attr,
+    &dev_attr_cpu_cpu_ns.attr,
+    &dev_attr_dma_frames.attr,
+    &dev_attr_dma_bytes.attr,
+    &dev_attr_dma_busy_ns.attr,
+    &dev_attr_dma_cpu_ns.attr,
+    &dev_attr_pin_frames.attr,
+    &dev_attr_pin_bytes.attr,
+    &dev_attr_pin_busy_ns.attr,
+    &dev_attr_pin_cpu_ns.attr,
+    NULL,
+};
+
+static const struct attribute_group caximem_copy_group = {
+    .name = "copy",
+    .attrs = caximem_copy_attrs,
+};
+
+/**
+ * Counters of the data path in the stats/ directory
+ */
+
+#define CAXIMEM_STATS_ATTR(_name)                                                                    \
+    static ssize_t _name##_show(struct device *device, struct device_attribute *attr, char *buf) {   \
+        struct caximem_device *caximem_dev = dev_get_drvdata(device);                               \
+        return sysfs_emit(buf, "%lld\n", (long long)atomic64_read(&caximem_dev->stats._name));      \
+    }                                                                                                \
+    static DEVICE_ATTR_RO(_name)
+
+CAXIMEM_STATS_ATTR(send_frames);
+CAXIMEM_STATS_ATTR(send_bytes);
+CAXIMEM_STATS_ATTR(send_truncated);
+CAXIMEM_STATS_ATTR(send_irqs);
+CAXIMEM_STATS_ATTR(recv_frames);
+CAXIMEM_STATS_ATTR(recv_bytes);
+CAXIMEM_STATS_ATTR(recv_short);
+CAXIMEM_STATS_ATTR(recv_irqs);
+CAXIMEM_STATS_ATTR(cancels);
+CAXIMEM_STATS_ATTR(recv_dropped);
+CAXIMEM_STATS_ATTR(send_records);
+CAXIMEM_STATS_ATTR(recv_records);
+
+static struct attribute *caximem_stats_attrs[] = {
+    &dev_attr_send_frames.attr,
+    &dev_attr_send_bytes.attr,
+    &dev_attr_send_truncated.attr,
+    &dev_attr_send_irqs.attr,
+    &dev_attr_recv_frames.attr,
+    &dev_attr_recv_bytes.attr,
+    &dev_attr_recv_short.attr,
+    &dev_attr_recv_irqs.attr,
+    &dev_attr_cancels.attr,
+    &dev_attr_recv_dropped.attr,
+    &dev_attr_send_records.attr,
+    &dev_attr_recv_records.attr,
+    NULL,
+};
+
+static const struct attribute_group caximem_stats_group = {
+    .name = "stats",
+    .attrs = caximem_stats_attrs,
+};
+
+const struct attribute_group *caximem_groups[] = {
+    &caximem_attr_group,
+    &caximem_copy_group,
+    &caximem_stats_group,
+    NULL,
+};
+
+/**
+ * Latency histograms in /sys/kernel/debug/caximem/<dev_name>_<id>
+ */
+
+static struct dentry *caximem_debugfs_root;
+
+/**
+ * @brief add a latency sample to a histogram
+ *
+ * @param hist The histogram
+ * @param ns The latency in nanoseconds
+ */
+void caximem_hist_add(struct caximem_hist *hist, u64 ns) {
+    unsigned int bucket;
+    bucket = ns ? fls64(ns) - 1 : 0;
+    if (bucket >= CAXIMEM_HIST_BUCKETS) {
+        bucket = CAXIMEM_HIST_BUCKETS - 1;
+    }
+    atomic64_inc(&hist->buckets[bucket]);
+}
+
+// Print the non-empty buckets as "<lower bound ns> <count>"
+static int caximem_hist_show(struct seq_file *s, void *data) {
+    struct caximem_hist *hist = s->private;
+    long long count;
+    int i;
+    for (i = 0; i < CAXIMEM_HIST_BUCKETS; i++) {
+        count = atomic64_read(&hist->buckets[i]);
+        if (count) {
+            seq_printf(s, "%llu %lld\n", i ? 1ull << i : 0ull, count);
+        }
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(caximem_hist);
+
+// Create the module debugfs directory, debugfs errors are not fatal
+void caximem_debugfs_register(void) {
+    caximem_debugfs_root = debugfs_create_dir(MODULE_NAME, NULL);
+}
+
+void caximem_debugfs_unregister(void) {
+    debugfs_remove_recursive(caximem_debugfs_root);
+    caximem_debugfs_root = NULL;
+}
+
+/**
+ * @brief create the histogram files of a device
+ *
+ * @param dev The caximem device
+ */
+void caximem_debugfs_init(struct caximem_device *dev) {
+    dev->debugfs = debugfs_create_dir(dev_name(dev->sys_device), caximem_debugfs_root);
+    debugfs_create_file("doorbell_irq_ns", 0444, dev->debugfs, &dev->stats.doorbell_irq, &caximem_hist_fops);
+    debugfs_create_file("irq_wakeup_ns", 0444, dev->debugfs, &dev->stats.irq_wakeup, &caximem_hist_fops);
+}
+
+void caximem_debugfs_exit(struct caximem_device *dev) {
+    debugfs_remove_recursive(dev->debugfs);
+    dev->debugfs = NULL;
+}
@@ -0,0 +1,111 @@
+/**
+ * @file caximem_trace.h
+ * @author wlanxww (xueweiwujxw@outlook.com)
+ * @brief tracepoints of the caximem data path, see /sys/kernel/tracing/events/caximem
+ * @version 0.1
+ * @date 2022-10-24
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM caximem
+
+#if !defined(CAXIMEM_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define CAXIMEM_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+#define caximem_trace_dir(send) ((send) ? "send" : "recv")
+
+// A write or SEND_COMMIT enters the driver
+TRACE_EVENT(caximem_write_start,
+            TP_PROTO(int dev_id, size_t size),
+            TP_ARGS(dev_id, size),
+            TP_STRUCT__entry(
+                __field(int, dev_id)
+                __field(size_t, size)),
+            TP_fast_assign(
+                __entry->dev_id = dev_id;
+                __entry->size = size;),
+            TP_printk("dev=%d size=%zu", __entry->dev_id, __entry->size));
+
+// A frame in the send window is handed to the PL
+TRACE_EVENT(caximem_doorbell,
+            TP_PROTO(int dev_id, size_t size),
+            TP_ARGS(dev_id, size),
+            TP_STRUCT__entry(
+                __field(int, dev_id)
+                __field(size_t, size)),
+            TP_fast_assign(
+                __entry->dev_id = dev_id;
+                __entry->size = size;),
+            TP_printk("dev=%d size=%zu", __entry->dev_id, __entry->size));
+
+// The send or recv interrupt, delay_ns is the time since the doorbell for send
+TRACE_EVENT(caximem_irq,
+            TP_PROTO(int dev_id, bool send, u64 delay_ns),
+            TP_ARGS(dev_id, send, delay_ns),
+            TP_STRUCT__entry(
+                __field(int, dev_id)
+                __field(bool, send)
+                __field(u64, delay_ns)),
+            TP_fast_assign(
+                __entry->dev_id = dev_id;
+                __entry->send = send;
+                __entry->delay_ns = delay_ns;),
+            TP_printk("dev=%d dir=%s delay_ns=%llu", __entry->dev_id, caximem_trace_dir(__entry->send),
+                      __entry->delay_ns));
+
+// A reader or writer sleeping on the interrupt runs again
+TRACE_EVENT(caximem_wakeup,
+            TP_PROTO(int dev_id, bool send, u64 latency_ns),
+            TP_ARGS(dev_id, send, latency_ns),
+            TP_STRUCT__entry(
+                __field(int, dev_id)
+                __field(bool, send)
+                __field(u64, latency_ns)),
+            TP_fast_assign(
+                __entry->dev_id = dev_id;
+                __entry->send = send;
+                __entry->latency_ns = latency_ns;),
+            TP_printk("dev=%d dir=%s latency_ns=%llu", __entry->dev_id, caximem_trace_dir(__entry->send),
+                      __entry->latency_ns));
+
+// A frame has been copied into the send window or out of the recv window
+TRACE_EVENT(caximem_copy_done,
+            TP_PROTO(int dev_id, bool send, size_t size, bool dma, u64 busy_ns),
+            TP_ARGS(dev_id, send, size, dma, busy_ns),
+            TP_STRUCT__entry(
+                __field(int, dev_id)
+                __field(bool, send)
+                __field(size_t, size)
+                __field(bool, dma)
+                __field(u64, busy_ns)),
+            TP_fast_assign(
+                __entry->dev_id = dev_id;
+                __entry->send = send;
+                __entry->size = size;
+                __entry->dma = dma;
+                __entry->busy_ns = busy_ns;),
+            TP_printk("dev=%d dir=%s size=%zu path=%s busy_ns=%llu", __entry->dev_id,
+                      caximem_trace_dir(__entry->send), __entry->size, __entry->dma ? "dma" : "cpu",
+                      __entry->busy_ns));
+
+// CAXIMEM_CANCEL
+TRACE_EVENT(caximem_cancel,
+            TP_PROTO(int dev_id),
+            TP_ARGS(dev_id),
+            TP_STRUCT__entry(
+                __field(int, dev_id)),
+            TP_fast_assign(
+                __entry->dev_id = dev_id;),
+            TP_printk("dev=%d", __entry->dev_id));
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE caximem_trace
+#include <trace/define_trace.h>
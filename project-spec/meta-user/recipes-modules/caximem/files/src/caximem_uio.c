@@ -0,0 +1,138 @@
+/**
+ * @file caximem_uio.c
+ * @author wlanxww (xueweiwujxw@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-11-02
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/interrupt.h>
+#include <linux/uio_driver.h>
+
+#include "caximem.h"
+
+/**
+ * User space binding through UIO
+ *
+ * With uio=1 the device is not exposed as a char device. Instead each
+ * direction is registered as a UIO device named <dev_name>_<id>_send and
+ * <dev_name>_<id>_recv. Map 0 of each is the whole BRAM window with its
+ * caximem_ctrl_t headers, and reading the UIO device returns the count of
+ * send_signal or recv_signal interrupts. lib/caximem_user.c does the
+ * enable / size handshake of caximem_write() and caximem_read() on the
+ * mapped windows, so the data path needs no system call.
+ */
+
+#define CAXIMEM_UIO_VERSION "0.1.0"
+
+struct caximem_uio
+{
+    struct uio_info send; // The send window and send_signal
+    struct uio_info recv; // The recv window and recv_signal
+    char send_name[32];   // The name of the send UIO device
+    char recv_name[32];   // The name of the recv UIO device
+};
+
+static irqreturn_t caximem_uio_handler(int irq, struct uio_info *info) {
+    // The signal is a pulse, there is nothing to acknowledge
+    return IRQ_HANDLED;
+}
+
+// Map the send window write-combining, UIO itself maps UIO_MEM_PHYS uncached
+static int caximem_uio_mmap_wc(struct uio_info *info, struct vm_area_struct *vma) {
+    struct uio_mem *mem;
+    unsigned long size;
+    if (vma->vm_pgoff != 0) {
+        return -EINVAL;
+    }
+    mem = &info->mem[0];
+    size = vma->vm_end - vma->vm_start;
+    if (size > mem->size) {
+        return -EINVAL;
+    }
+    vma->vm_flags |= VM_IO | VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+    return io_remap_pfn_range(vma, vma->vm_start, mem->addr >> PAGE_SHIFT, size, vma->vm_page_prot);
+}
+
+static void caximem_uio_info(struct uio_info *info, const char *name, int irq, unsigned long offset,
+                             unsigned long size) {
+    info->name = name;
+    info->version = CAXIMEM_UIO_VERSION;
+    info->irq = irq;
+    // The same trigger as the char device interrupts
+    info->irq_flags = IRQF_TRIGGER_RISING;
+    info->handler = caximem_uio_handler;
+    info->mem[0].name = name;
+    info->mem[0].addr = offset;
+    info->mem[0].size = PAGE_ALIGN(size);
+    info->mem[0].memtype = UIO_MEM_PHYS;
+}
+
+/**
+ * @brief register the send and recv windows as UIO devices
+ *
+ * @param dev The caximem device
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+int caximem_uio_init(struct caximem_device *dev) {
+    struct caximem_uio *uio;
+    int rc;
+
+    if (dev->sim) {
+        // The simulated PL only sees control headers written by the driver
+        caximem_err("uio is not supported by the simulated device.\n");
+        return -EINVAL;
+    }
+    if ((dev->send_offset | dev->recv_offset) & ~PAGE_MASK) {
+        caximem_err("uio needs page aligned windows.\n");
+        return -EINVAL;
+    }
+    uio = kzalloc(sizeof(*uio), GFP_KERNEL);
+    if (uio == NULL) {
+        return -ENOMEM;
+    }
+    snprintf(uio->send_name, sizeof(uio->send_name), "%s_%d_send", dev->dev_name, dev->dev_id);
+    snprintf(uio->recv_name, sizeof(uio->recv_name), "%s_%d_recv", dev->dev_name, dev->dev_id);
+    caximem_uio_info(&uio->send, uio->send_name, dev->send_signal, dev->send_offset, dev->send_max_size);
+    caximem_uio_info(&uio->recv, uio->recv_name, dev->recv_signal, dev->recv_offset, dev->recv_max_size);
+    if (dev->send_wc) {
+        // ctrl_set of lib/caximem_user.c fences the frame before the header
+        uio->send.mmap = caximem_uio_mmap_wc;
+    }
+
+    rc = uio_register_device(&dev->pdev->dev, &uio->send);
+    if (rc < 0) {
+        caximem_err("failed to register uio device %s.\n", uio->send_name);
+        goto free_uio;
+    }
+    rc = uio_register_device(&dev->pdev->dev, &uio->recv);
+    if (rc < 0) {
+        caximem_err("failed to register uio device %s.\n", uio->recv_name);
+        goto unregister_send;
+    }
+    dev->uio = uio;
+    caximem_info("uio devices %s %s registered.\n", uio->send_name, uio->recv_name);
+    return 0;
+
+unregister_send:
+    uio_unregister_device(&uio->send);
+free_uio:
+    kfree(uio);
+    return rc;
+}
+
+void caximem_uio_exit(struct caximem_device *dev) {
+    if (dev->uio == NULL) {
+        return;
+    }
+    uio_unregister_device(&dev->uio->recv);
+    uio_unregister_device(&dev->uio->send);
+    kfree(dev->uio);
+    dev->uio = NULL;
+}
@@ -0,0 +1,373 @@
+/**
+ * @file caximem_uring.c
+ * @author wlanxww (xueweiwujxw@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-11-06
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/uio.h>
+#include <linux/ktime.h>
+
+#include "caximem.h"
+
+/**
+ * Submission and completion rings shared with user space
+ *
+ * CAXIMEM_URING_SETUP allocates one region holding the ring indices, the
+ * submission and completion entries and the frame buffers, and user space
+ * maps it at CAXIMEM_MMAP_URING_OFFSET. A work item moves submissions into
+ * a send and a recv list, so a recv waiting for its frame does not hold up
+ * the sends behind it. It drives the caximem_ctrl_t handshake without ever
+ * sleeping and is queued again by the send and recv interrupts, which is how
+ * submissions are picked up without a system call while frames are in
+ * flight. When neither a send nor a recv is in flight the driver sets
+ * CAXIMEM_URING_NEED_WAKEUP and user space kicks it with
+ * CAXIMEM_URING_ENTER.
+ *
+ * While the rings are set up they own the device, read, write and the
+ * commit ioctls return -EBUSY.
+ */
+
+#define CAXIMEM_URING_MAX_ENTRIES 4096
+#define CAXIMEM_URING_MAX_BUFS 1024
+
+// Post a completion, it is dropped and counted if user space lets the ring fill up
+static bool caximem_uring_post(struct caximem_uring *uring, struct caximem_uring_op *op, s32 res, u32 flags,
+                               u64 complete_ns) {
+    struct caximem_uring_ring *ring = uring->ring;
+    struct caximem_cqe *cqe;
+    unsigned int tail;
+    tail = ring->cq_tail;
+    if (tail - smp_load_acquire(&ring->cq_head) > uring->cq_mask) {
+        WRITE_ONCE(ring->dropped, ring->dropped + 1);
+        return false;
+    }
+    cqe = &uring->cqes[tail & uring->cq_mask];
+    cqe->user_data = op->sqe.user_data;
+    cqe->res = res;
+    cqe->flags = flags;
+    cqe->submit_ns = op->submit_ns;
+    cqe->complete_ns = complete_ns;
+    smp_store_release(&ring->cq_tail, tail + 1);
+    return true;
+}
+
+static bool caximem_uring_list_full(struct caximem_uring *uring, struct caximem_uring_list *list) {
+    return list->tail - list->head > uring->sq_mask;
+}
+
+/**
+ * @brief move new submissions into the send and recv lists
+ *
+ * @param uring The rings
+ * @return bool Returns true if a completion was posted for an invalid submission
+ */
+static bool caximem_uring_fetch(struct caximem_uring *uring) {
+    struct caximem_uring_ring *ring = uring->ring;
+    struct caximem_uring_list *list;
+    struct caximem_uring_op op;
+    unsigned int head, tail, n;
+    bool posted = false;
+
+    head = ring->sq_head;
+    tail = smp_load_acquire(&ring->sq_tail);
+    // sq_tail is written by user space, never take more than the ring holds
+    for (n = 0; head != tail && n <= uring->sq_mask; n++) {
+        memcpy(&op.sqe, &uring->sqes[head & uring->sq_mask], sizeof(op.sqe));
+        op.submit_ns = ktime_get_ns();
+        list = op.sqe.opcode == CAXIMEM_OP_SEND ? &uring->send : &uring->recv;
+        if (op.sqe.opcode > CAXIMEM_OP_RECV || op.sqe.buf_index >= uring->buf_count || op.sqe.len > uring->buf_size) {
+            posted |= caximem_uring_post(uring, &op, -EINVAL, 0, op.submit_ns);
+        } else if (caximem_uring_list_full(uring, list)) {
+            break;
+        } else {
+            list->ops[list->tail & uring->sq_mask] = op;
+            list->tail++;
+        }
+        head++;
+    }
+    smp_store_release(&ring->sq_head, head);
+    return posted;
+}
+
+// The frame buffer of a submission as an iterator
+static void caximem_uring_iter(struct caximem_uring *uring, struct caximem_uring_op *op, unsigned int dir,
+                               size_t length, struct kvec *kvec, struct iov_iter *iter) {
+    kvec->iov_base = (char *)uring->bufs + op->sqe.buf_index * uring->buf_size;
+    kvec->iov_len = length;
+    iov_iter_kvec(iter, dir, kvec, 1, length);
+}
+
+/**
+ * @brief complete the sends the PL is done with and hand waiting ones to free slots
+ *
+ * @param dev The caximem device
+ * @return bool Returns true if a completion was posted
+ */
+static bool caximem_uring_send(struct caximem_device *dev) {
+    struct caximem_uring *uring = &dev->uring;
+    struct caximem_uring_list *list = &uring->send;
+    struct caximem_uring_op *op;
+    struct kvec kvec;
+    struct iov_iter iter;
+    unsigned int inflight, done;
+    bool posted = false;
+
+    // send_wait counts the slots still owned by the PL, all of them were filled here
+    inflight = list->issued - list->head;
+    done = inflight - min_t(unsigned int, inflight, atomic_read(&dev->send_wait));
+    while (done--) {
+        op = &list->ops[list->head & uring->sq_mask];
+        posted |= caximem_uring_post(uring, op, op->sqe.len, 0, READ_ONCE(dev->send_irq_ns));
+        list->head++;
+    }
+
+    while (list->issued != list->tail && caximem_send_idle(dev)) {
+        op = &list->ops[list->issued & uring->sq_mask];
+        caximem_uring_iter(uring, op, WRITE, op->sqe.len, &kvec, &iter);
+        caximem_copy_to_window(dev, &iter, 0, op->sqe.len);
+        list->issued++;
+        caximem_send_locked(dev, op->sqe.len, true);
+    }
+    return posted;
+}
+
+/**
+ * @brief complete the recvs whose frame has arrived, the next one stays armed
+ *
+ * @param dev The caximem device
+ * @return bool Returns true if a completion was posted
+ */
+static bool caximem_uring_recv(struct caximem_device *dev) {
+    struct caximem_uring *uring = &dev->uring;
+    struct caximem_uring_list *list = &uring->recv;
+    struct caximem_uring_op *op;
+    struct kvec kvec;
+    struct iov_iter iter;
+    size_t size, length;
+    bool posted = false;
+
+    while (list->head != list->tail) {
+        if (caximem_recv_locked(dev, true, &size) < 0) {
+            // Armed, the recv interrupt queues the work again
+            break;
+        }
+        op = &list->ops[list->head & uring->sq_mask];
+        length = min_t(size_t, size, op->sqe.len);
+        caximem_uring_iter(uring, op, READ, length, &kvec, &iter);
+        caximem_copy_from_window(dev, &iter, 0, length);
+        caximem_recv_disarm(dev);
+        posted |= caximem_uring_post(uring, op, length, size > length ? CAXIMEM_CQE_TRUNC : 0,
+                                     READ_ONCE(dev->recv_irq_ns));
+        list->head++;
+    }
+    return posted;
+}
+
+static void caximem_uring_work(struct work_struct *work) {
+    struct caximem_uring *uring = container_of(work, struct caximem_uring, work);
+    struct caximem_device *dev = container_of(uring, struct caximem_device, uring);
+    struct caximem_uring_ring *ring;
+    bool posted;
+
+    if (!READ_ONCE(uring->active)) {
+        return;
+    }
+    ring = uring->ring;
+    posted = caximem_uring_fetch(uring);
+    posted |= caximem_uring_send(dev);
+    posted |= caximem_uring_recv(dev);
+
+    if (uring->send.issued == uring->send.head && uring->recv.head == uring->recv.tail) {
+        // No interrupt will queue the work, check for submissions racing with the flag
+        WRITE_ONCE(ring->flags, ring->flags | CAXIMEM_URING_NEED_WAKEUP);
+        smp_mb();
+        if (READ_ONCE(ring->sq_tail) != ring->sq_head) {
+            WRITE_ONCE(ring->flags, ring->flags & ~CAXIMEM_URING_NEED_WAKEUP);
+            queue_work(system_highpri_wq, &uring->work);
+        }
+    } else {
+        WRITE_ONCE(ring->flags, ring->flags & ~CAXIMEM_URING_NEED_WAKEUP);
+    }
+    if (posted) {
+        wake_up(&uring->cq_wait);
+    }
+}
+
+// Queue the work from the interrupt handlers
+void caximem_uring_kick(struct caximem_device *dev) {
+    if (READ_ONCE(dev->uring.active)) {
+        queue_work(system_highpri_wq, &dev->uring.work);
+    }
+}
+
+// Prepare the work and wait queue once for the life time of the device
+void caximem_uring_init(struct caximem_device *dev) {
+    INIT_WORK(&dev->uring.work, caximem_uring_work);
+    init_waitqueue_head(&dev->uring.cq_wait);
+    init_rwsem(&dev->uring.lock);
+}
+
+/**
+ * @brief allocate the rings and let them own the device
+ *
+ * @param dev The caximem device, send_sem and recv_sem must be held
+ * @param params The requested sizes, the offsets in the region are returned
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+static int caximem_uring_alloc(struct caximem_device *dev, struct caximem_uring_params *params) {
+    struct caximem_uring *uring = &dev->uring;
+    unsigned int sq_entries, cq_entries;
+    size_t sq_off, cq_off, buf_off, buf_size, size;
+
+    if (uring->active) {
+        return -EBUSY;
+    }
+    if (dev->send_queue_slots || dev->recv_ring_slots || dev->msg_max_size) {
+        // The queue, ring and message modes have their own workers
+        return -EINVAL;
+    }
+    if (params->sq_entries == 0 || params->sq_entries > CAXIMEM_URING_MAX_ENTRIES || params->buf_count == 0 ||
+        params->buf_count > CAXIMEM_URING_MAX_BUFS || params->cq_entries > 2 * CAXIMEM_URING_MAX_ENTRIES) {
+        return -EINVAL;
+    }
+    sq_entries = roundup_pow_of_two(params->sq_entries);
+    // Both lists may complete at once, by default the completion ring holds them all
+    cq_entries = roundup_pow_of_two(params->cq_entries ? params->cq_entries : 2 * sq_entries);
+    buf_size = ALIGN(max_t(size_t, dev->send_slot_size, dev->recv_max_size) - sizeof(caximem_ctrl_t), 64);
+
+    sq_off = ALIGN(sizeof(struct caximem_uring_ring), 64);
+    cq_off = ALIGN(sq_off + sq_entries * sizeof(struct caximem_sqe), 64);
+    buf_off = PAGE_ALIGN(cq_off + cq_entries * sizeof(struct caximem_cqe));
+    size = PAGE_ALIGN(buf_off + params->buf_count * buf_size);
+
+    uring->send.ops = kcalloc(sq_entries, sizeof(struct caximem_uring_op), GFP_KERNEL);
+    uring->recv.ops = kcalloc(sq_entries, sizeof(struct caximem_uring_op), GFP_KERNEL);
+    uring->mem = vmalloc_user(size);
+    if (uring->send.ops == NULL || uring->recv.ops == NULL || uring->mem == NULL) {
+        vfree(uring->mem);
+        kfree(uring->recv.ops);
+        kfree(uring->send.ops);
+        uring->mem = NULL;
+        uring->recv.ops = NULL;
+        uring->send.ops = NULL;
+        return -ENOMEM;
+    }
+    uring->size = size;
+    uring->ring = uring->mem;
+    uring->sqes = (struct caximem_sqe *)((char *)uring->mem + sq_off);
+    uring->cqes = (struct caximem_cqe *)((char *)uring->mem + cq_off);
+    uring->bufs = (char *)uring->mem + buf_off;
+    uring->sq_mask = sq_entries - 1;
+    uring->cq_mask = cq_entries - 1;
+    uring->buf_count = params->buf_count;
+    uring->buf_size = buf_size;
+    uring->send.head = uring->send.issued = uring->send.tail = 0;
+    uring->recv.head = uring->recv.issued = uring->recv.tail = 0;
+    uring->ring->sq_mask = uring->sq_mask;
+    uring->ring->cq_mask = uring->cq_mask;
+    uring->ring->flags = CAXIMEM_URING_NEED_WAKEUP;
+
+    params->sq_entries = sq_entries;
+    params->cq_entries = cq_entries;
+    params->buf_size = buf_size;
+    params->sq_off = sq_off;
+    params->cq_off = cq_off;
+    params->buf_off = buf_off;
+    params->size = size;
+    WRITE_ONCE(uring->active, true);
+    return 0;
+}
+
+int caximem_uring_setup(struct caximem_device *dev, struct caximem_uring_params *params) {
+    int rc;
+    down_write(&dev->uring.lock);
+    rc = caximem_uring_alloc(dev, params);
+    up_write(&dev->uring.lock);
+    return rc;
+}
+
+// Stop the work and free the rings, the device is usable by read and write again
+void caximem_uring_free(struct caximem_device *dev) {
+    struct caximem_uring *uring = &dev->uring;
+    // The waiters in caximem_uring_enter hold lock, let them return first
+    WRITE_ONCE(uring->active, false);
+    wake_up(&uring->cq_wait);
+    down_write(&uring->lock);
+    if (uring->mem == NULL) {
+        up_write(&uring->lock);
+        return;
+    }
+    cancel_work_sync(&uring->work);
+    vfree(uring->mem);
+    kfree(uring->recv.ops);
+    kfree(uring->send.ops);
+    uring->mem = NULL;
+    uring->ring = NULL;
+    uring->recv.ops = NULL;
+    uring->send.ops = NULL;
+    up_write(&uring->lock);
+}
+
+/**
+ * @brief kick the work and optionally wait for completions
+ *
+ * @param dev The caximem device
+ * @param enter The number of completions to wait for
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+int caximem_uring_enter(struct caximem_device *dev, struct caximem_uring_enter *enter) {
+    struct caximem_uring *uring = &dev->uring;
+    int rc = 0;
+    down_read(&uring->lock);
+    if (!uring->active) {
+        rc = -EINVAL;
+        goto up_lock;
+    }
+    queue_work(system_highpri_wq, &uring->work);
+    if (enter->min_complete == 0) {
+        goto up_lock;
+    }
+    // The rings stay mapped while lock is held, caximem_uring_free clears active before taking it
+    if (wait_event_interruptible(uring->cq_wait,
+                                 !READ_ONCE(uring->active) || READ_ONCE(uring->ring->cq_tail) -
+                                                                      READ_ONCE(uring->ring->cq_head) >=
+                                                                  enter->min_complete)) {
+        rc = -ERESTARTSYS;
+    } else if (!READ_ONCE(uring->active)) {
+        rc = -EINVAL;
+    }
+up_lock:
+    up_read(&uring->lock);
+    return rc;
+}
+
+/**
+ * @brief map the rings and frame buffers into user space
+ *
+ * @param dev The caximem device
+ * @param vma The virtual memory area at CAXIMEM_MMAP_URING_OFFSET
+ * @return int Returns 0, or error code less than 0 for errors
+ */
+int caximem_uring_mmap(struct caximem_device *dev, struct vm_area_struct *vma) {
+    int rc;
+    if (vma->vm_pgoff != CAXIMEM_MMAP_URING_OFFSET >> PAGE_SHIFT) {
+        return -EINVAL;
+    }
+    down_read(&dev->uring.lock);
+    if (dev->uring.active) {
+        rc = remap_vmalloc_range(vma, dev->uring.mem, 0);
+    } else {
+        rc = -EINVAL;
+    }
+    up_read(&dev->uring.lock);
+    return rc;
+}
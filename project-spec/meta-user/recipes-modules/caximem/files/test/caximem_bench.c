@@ -0,0 +1,485 @@
+/**
+ * @file caximem_bench.c
+ * @author wlanxww (xueweiwujxw@outlook.com)
+ * @brief throughput and latency benchmark of a caximem device
+ * @version 0.1
+ * @date 2022-10-28
+ *
+ * @copyright Copyright (c) 2022
+ *
+ * Modes:
+ *   oneway    A writer sends the frames, latency is the time of each write.
+ *             A reader drains frames looped back by the PL or the simulated backend.
+ *   pingpong  Each frame is written and read back, latency is the round trip.
+ *   duplex    A writer and a reader run at the same time, latency is from the
+ *             timestamp in the frame to its receive (frames of at least 8 bytes).
+ *   transact  Like pingpong, with one CAXIMEM_TRANSACT call per round trip.
+ *
+ * Without --size the frame size is swept in powers of two from 4 bytes up to
+ * the largest frame of the device.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
+
+#include "caximem_ioctl.h"
+
+#define MIN_FRAME 4
+#define DRAIN_TIMEOUT_S 1
+
+enum bench_mode
+{
+    MODE_ONEWAY,
+    MODE_PINGPONG,
+    MODE_DUPLEX,
+    MODE_TRANSACT,
+};
+
+static const char *mode_names[] = {"oneway", "pingpong", "duplex", "transact"};
+
+struct bench_config
+{
+    const char *device;  // The device node
+    enum bench_mode mode; // The benchmark mode
+    size_t min_size;     // The smallest frame size of the sweep
+    size_t max_size;     // The largest frame size of the sweep
+    long frames;         // The number of frames of each size
+    int tx_cpu;          // The cpu of the writer, -1 for any
+    int rx_cpu;          // The cpu of the reader, -1 for any
+    int json;            // Print the results as json
+};
+
+struct bench_result
+{
+    size_t size;         // The frame size
+    long frames;         // The number of frames transferred
+    uint64_t elapsed_ns; // The time of the run
+    uint64_t *lat;       // The latency samples in ns
+    long samples;        // The number of latency samples
+};
+
+struct bench_thread
+{
+    int fd;                      // The device
+    size_t size;                 // The frame size
+    long frames;                 // The number of frames to transfer
+    int cpu;                     // The cpu to run on, -1 for any
+    struct bench_result *result; // Where to store latencies, NULL to only count
+    long done;                   // The number of frames transferred
+    uint64_t end_ns;             // The time of the last frame
+    int err;                     // The errno of a failed transfer
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void pin_cpu(int cpu) {
+    cpu_set_t set;
+    if (cpu < 0) {
+        return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+        fprintf(stderr, "failed to pin to cpu %d.\n", cpu);
+    }
+}
+
+static void *writer_thread(void *arg) {
+    struct bench_thread *t = arg;
+    char *buf;
+    uint64_t start, stamp;
+    long i;
+    pin_cpu(t->cpu);
+    buf = calloc(1, t->size);
+    if (buf == NULL) {
+        t->err = ENOMEM;
+        return NULL;
+    }
+    for (i = 0; i < t->frames; i++) {
+        start = now_ns();
+        if (t->size >= sizeof(stamp)) {
+            memcpy(buf, &start, sizeof(stamp));
+        }
+        if (write(t->fd, buf, t->size) < 0) {
+            t->err = errno;
+            break;
+        }
+        t->end_ns = now_ns();
+        if (t->result) {
+            t->result->lat[t->result->samples++] = t->end_ns - start;
+        }
+        t->done++;
+    }
+    free(buf);
+    return NULL;
+}
+
+static void *reader_thread(void *arg) {
+    struct bench_thread *t = arg;
+    char *buf;
+    uint64_t stamp;
+    ssize_t ret;
+    pin_cpu(t->cpu);
+    buf = malloc(t->size);
+    if (buf == NULL) {
+        t->err = ENOMEM;
+        return NULL;
+    }
+    while (t->done < t->frames) {
+        ret = read(t->fd, buf, t->size);
+        if (ret < 0) {
+            t->err = errno;
+            break;
+        } else if (ret == 0) {
+            // Canceled
+            break;
+        }
+        t->end_ns = now_ns();
+        if (t->result && (size_t)ret >= sizeof(stamp)) {
+            memcpy(&stamp, buf, sizeof(stamp));
+            t->result->lat[t->result->samples++] = t->end_ns - stamp;
+        }
+        t->done++;
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * @brief wait for the reader, cancel it if no frame comes back
+ *
+ * @param fd The device
+ * @param reader The reader thread
+ */
+static void join_reader(int fd, pthread_t reader) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += DRAIN_TIMEOUT_S;
+    if (pthread_timedjoin_np(reader, NULL, &ts)) {
+        ioctl(fd, CAXIMEM_CANCEL);
+        pthread_join(reader, NULL);
+    }
+}
+
+static int run_oneway(const struct bench_config *cfg, int fd, struct bench_result *res) {
+    struct bench_thread tx = {.fd = fd, .size = res->size, .frames = cfg->frames, .cpu = cfg->tx_cpu, .result = res};
+    struct bench_thread rx = {.fd = fd, .size = res->size, .frames = cfg->frames, .cpu = cfg->rx_cpu, .result = NULL};
+    pthread_t writer, reader;
+    uint64_t start;
+    if (pthread_create(&reader, NULL, reader_thread, &rx)) {
+        return -1;
+    }
+    start = now_ns();
+    if (pthread_create(&writer, NULL, writer_thread, &tx)) {
+        ioctl(fd, CAXIMEM_CANCEL);
+        pthread_join(reader, NULL);
+        return -1;
+    }
+    pthread_join(writer, NULL);
+    join_reader(fd, reader);
+    res->frames = tx.done;
+    res->elapsed_ns = tx.done ? tx.end_ns - start : 0;
+    errno = tx.err;
+    return tx.err ? -1 : 0;
+}
+
+static int run_pingpong(const struct bench_config *cfg, int fd, struct bench_result *res) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    char *sbuf, *rbuf;
+    uint64_t start, t0;
+    long i;
+    int rc = 0;
+    pin_cpu(cfg->tx_cpu);
+    sbuf = calloc(1, res->size);
+    rbuf = malloc(res->size);
+    if (sbuf == NULL || rbuf == NULL) {
+        free(sbuf);
+        free(rbuf);
+        errno = ENOMEM;
+        return -1;
+    }
+    start = now_ns();
+    for (i = 0; i < cfg->frames; i++) {
+        t0 = now_ns();
+        // poll arms the recv window, so the frame can come back while write waits
+        poll(&pfd, 1, 0);
+        if (write(fd, sbuf, res->size) < 0 || read(fd, rbuf, res->size) <= 0) {
+            rc = -1;
+            break;
+        }
+        res->lat[res->samples++] = now_ns() - t0;
+    }
+    res->frames = i;
+    res->elapsed_ns = now_ns() - start;
+    free(sbuf);
+    free(rbuf);
+    return rc;
+}
+
+static int run_transact(const struct bench_config *cfg, int fd, struct bench_result *res) {
+    struct caximem_transact xact;
+    char *sbuf, *rbuf;
+    uint64_t start, t0;
+    long i;
+    int rc = 0;
+    pin_cpu(cfg->tx_cpu);
+    sbuf = calloc(1, res->size);
+    rbuf = malloc(res->size);
+    if (sbuf == NULL || rbuf == NULL) {
+        free(sbuf);
+        free(rbuf);
+        errno = ENOMEM;
+        return -1;
+    }
+    start = now_ns();
+    for (i = 0; i < cfg->frames; i++) {
+        t0 = now_ns();
+        memset(&xact, 0, sizeof(xact));
+        xact.req = (uintptr_t)sbuf;
+        xact.req_len = res->size;
+        xact.resp = (uintptr_t)rbuf;
+        xact.resp_len = res->size;
+        if (ioctl(fd, CAXIMEM_TRANSACT, &xact) < 0 || xact.resp_len == 0) {
+            rc = -1;
+            break;
+        }
+        res->lat[res->samples++] = now_ns() - t0;
+    }
+    res->frames = i;
+    res->elapsed_ns = now_ns() - start;
+    free(sbuf);
+    free(rbuf);
+    return rc;
+}
+
+static int run_duplex(const struct bench_config *cfg, int fd, struct bench_result *res) {
+    struct bench_thread tx = {.fd = fd, .size = res->size, .frames = cfg->frames, .cpu = cfg->tx_cpu, .result = NULL};
+    struct bench_thread rx = {.fd = fd, .size = res->size, .frames = cfg->frames, .cpu = cfg->rx_cpu, .result = res};
+    pthread_t writer, reader;
+    uint64_t start;
+    if (pthread_create(&reader, NULL, reader_thread, &rx)) {
+        return -1;
+    }
+    start = now_ns();
+    if (pthread_create(&writer, NULL, writer_thread, &tx)) {
+        ioctl(fd, CAXIMEM_CANCEL);
+        pthread_join(reader, NULL);
+        return -1;
+    }
+    pthread_join(writer, NULL);
+    join_reader(fd, reader);
+    // Both directions move the same frames, count what made it through
+    res->frames = rx.done;
+    res->elapsed_ns = rx.done ? rx.end_ns - start : 0;
+    errno = tx.err ? tx.err : rx.err;
+    return errno ? -1 : 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const struct bench_result *res, double p) {
+    long i;
+    if (res->samples == 0) {
+        return 0;
+    }
+    i = (long)(p * (res->samples - 1) + 0.5);
+    return res->lat[i];
+}
+
+static void report(const struct bench_config *cfg, struct bench_result *res, int first) {
+    double secs, mbps, fps;
+    qsort(res->lat, res->samples, sizeof(*res->lat), cmp_u64);
+    secs = res->elapsed_ns ? res->elapsed_ns / 1e9 : 1e-9;
+    fps = res->frames / secs;
+    mbps = fps * res->size / 1e6;
+    if (cfg->json) {
+        printf("%s    {\"mode\": \"%s\", \"size\": %zu, \"frames\": %ld, \"mb_per_s\": %.3f, \"frames_per_s\": %.1f, "
+               "\"latency_ns\": {\"samples\": %ld, \"p50\": %llu, \"p99\": %llu, \"p99.9\": %llu, \"max\": %llu}}",
+               first ? "" : ",\n", mode_names[cfg->mode], res->size, res->frames, mbps, fps, res->samples,
+               (unsigned long long)percentile(res, 0.50), (unsigned long long)percentile(res, 0.99),
+               (unsigned long long)percentile(res, 0.999),
+               (unsigned long long)(res->samples ? res->lat[res->samples - 1] : 0));
+        return;
+    }
+    if (first) {
+        printf("%-8s %8s %10s %10s %12s %10s %10s %10s %10s\n", "mode", "size", "frames", "MB/s", "frames/s",
+               "p50(us)", "p99(us)", "p99.9(us)", "max(us)");
+    }
+    printf("%-8s %8zu %10ld %10.2f %12.0f %10.2f %10.2f %10.2f %10.2f\n", mode_names[cfg->mode], res->size,
+           res->frames, mbps, fps, percentile(res, 0.50) / 1e3, percentile(res, 0.99) / 1e3,
+           percentile(res, 0.999) / 1e3, (res->samples ? res->lat[res->samples - 1] : 0) / 1e3);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -d, --device PATH   device node (default /dev/caximem_0)\n"
+            "  -m, --mode MODE     oneway, pingpong, duplex or transact (default oneway)\n"
+            "  -s, --size N        only run frames of N bytes\n"
+            "      --min-size N    smallest frame of the sweep (default %d)\n"
+            "      --max-size N    largest frame of the sweep (default the device maximum)\n"
+            "  -n, --frames N      frames of each size (default 10000)\n"
+            "      --tx-cpu N      pin the writer to cpu N\n"
+            "      --rx-cpu N      pin the reader to cpu N\n"
+            "  -j, --json          print the results as json\n",
+            prog, MIN_FRAME);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option options[] = {
+        {"device", required_argument, NULL, 'd'},
+        {"mode", required_argument, NULL, 'm'},
+        {"size", required_argument, NULL, 's'},
+        {"min-size", required_argument, NULL, 'a'},
+        {"max-size", required_argument, NULL, 'b'},
+        {"frames", required_argument, NULL, 'n'},
+        {"tx-cpu", required_argument, NULL, 't'},
+        {"rx-cpu", required_argument, NULL, 'r'},
+        {"json", no_argument, NULL, 'j'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    struct bench_config cfg = {
+        .device = "/dev/caximem_0",
+        .mode = MODE_ONEWAY,
+        .min_size = MIN_FRAME,
+        .max_size = 0,
+        .frames = 10000,
+        .tx_cpu = -1,
+        .rx_cpu = -1,
+        .json = 0,
+    };
+    struct caximem_info info;
+    struct bench_result res;
+    size_t size, limit;
+    int opt, fd, rc, first;
+
+    while ((opt = getopt_long(argc, argv, "d:m:s:n:jh", options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            cfg.device = optarg;
+            break;
+        case 'm':
+            for (cfg.mode = 0; cfg.mode <= MODE_TRANSACT; cfg.mode++) {
+                if (!strcmp(optarg, mode_names[cfg.mode]))
+                    break;
+            }
+            if (cfg.mode > MODE_TRANSACT) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 's':
+            cfg.min_size = cfg.max_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'a':
+            cfg.min_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            cfg.max_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            cfg.frames = strtol(optarg, NULL, 0);
+            break;
+        case 't':
+            cfg.tx_cpu = atoi(optarg);
+            break;
+        case 'r':
+            cfg.rx_cpu = atoi(optarg);
+            break;
+        case 'j':
+            cfg.json = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (cfg.frames <= 0 || cfg.min_size == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    fd = open(cfg.device, O_RDWR | O_EXCL);
+    if (fd < 0) {
+        fprintf(stderr, "open %s failed. %s.\n", cfg.device, strerror(errno));
+        return 1;
+    }
+    if (ioctl(fd, CAXIMEM_GET_INFO, &info) < 0) {
+        fprintf(stderr, "get info failed. %s.\n", strerror(errno));
+        close(fd);
+        return 1;
+    }
+    // Frames come back through the recv window in every mode
+    limit = info.send_max_frame < info.recv_max_frame ? info.send_max_frame : info.recv_max_frame;
+    if (cfg.max_size == 0 || cfg.max_size > limit) {
+        cfg.max_size = limit;
+    }
+
+    res.lat = malloc(cfg.frames * sizeof(*res.lat));
+    if (res.lat == NULL) {
+        close(fd);
+        return 1;
+    }
+    if (cfg.json) {
+        printf("[\n");
+    }
+    rc = 0;
+    first = 1;
+    for (size = cfg.min_size;; size *= 2) {
+        if (size > cfg.max_size) {
+            size = cfg.max_size;
+        }
+        res.size = size;
+        res.frames = 0;
+        res.samples = 0;
+        res.elapsed_ns = 0;
+        switch (cfg.mode) {
+        case MODE_ONEWAY:
+            rc = run_oneway(&cfg, fd, &res);
+            break;
+        case MODE_PINGPONG:
+            rc = run_pingpong(&cfg, fd, &res);
+            break;
+        case MODE_DUPLEX:
+            rc = run_duplex(&cfg, fd, &res);
+            break;
+        case MODE_TRANSACT:
+            rc = run_transact(&cfg, fd, &res);
+            break;
+        }
+        if (rc < 0) {
+            fprintf(stderr, "%s of %zu bytes failed. %s.\n", mode_names[cfg.mode], size, strerror(errno));
+            break;
+        }
+        report(&cfg, &res, first);
+        first = 0;
+        if (size == cfg.max_size) {
+            break;
+        }
+    }
+    if (cfg.json) {
+        printf("\n]\n");
+    }
+    free(res.lat);
+    close(fd);
+    return rc < 0;
+}